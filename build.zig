@@ -641,7 +641,10 @@ fn build_wolfssl() *Step {
         \\      --enable-aesgcm \
         \\      --disable-aescbc \
         \\      --enable-sni \
-        \\      --disable-session-ticket \
+        \\      --enable-alpn \
+        \\      --enable-session-ticket \
+        \\      --enable-earlydata \
+        \\      --enable-atomicuser \
         \\      --disable-md5 \
         \\      --disable-sha \
         \\      --disable-sha3 \
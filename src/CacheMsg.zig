@@ -5,6 +5,7 @@ const cc = @import("cc.zig");
 const dns = @import("dns.zig");
 const log = @import("log.zig");
 const Node = @import("Node.zig");
+const Tag = @import("tag.zig").Tag;
 const Bytes = cc.Bytes;
 
 // =======================================================
@@ -20,6 +21,11 @@ ttl_r: i32, // refresh if ttl <= ttl_r
 msg_len: u16,
 qnamelen: u8,
 added_ip: bool = true, // for db cache
+hits: u16 = 0, // hits since the last update (prefetch)
+prefetch_idx: ?u32 = null, // index in the prefetch queue
+prefetching: bool = false, // the prefetch query is in flight
+prefetched: bool = false, // updated by prefetch, not hit yet
+tag: ?Tag = null, // tag of the question (null: unknown, e.g. loaded from db)
 // msg: [msg_len]u8, // {header, question, answer, authority, additional}
 
 // =======================================================
@@ -104,6 +110,11 @@ pub fn update_ttl(self: *CacheMsg) i32 {
     return self.ttl;
 }
 
+/// the time when the ttl reaches 0 (monotonic while cached)
+pub fn expire_time(self: *const CacheMsg) c.time_t {
+    return self.update_time + self.ttl;
+}
+
 /// return `ttl` (<= 0 means expired)
 pub fn get_ttl(self: *const CacheMsg) i32 {
     return self.ttl + self.calc_ttl_change(cc.time());
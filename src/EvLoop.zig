@@ -457,7 +457,9 @@ pub fn wait_writable(self: *EvLoop, fdobj: *Fd) ?void {
         return null;
 }
 
-pub fn connect(self: *EvLoop, fdobj: *Fd, addr: *const cc.SockAddr) ?void {
+/// return `true` if connect() succeeded immediately: with `TCP_FASTOPEN_CONNECT`,
+/// the SYN is deferred to the first write and carries the data (tcp fastopen)
+pub fn connect(self: *EvLoop, fdobj: *Fd, addr: *const cc.SockAddr) ?bool {
     cc.connect(fdobj.fd, addr) orelse {
         if (cc.errno() != c.EINPROGRESS)
             return null;
@@ -470,7 +472,7 @@ pub fn connect(self: *EvLoop, fdobj: *Fd, addr: *const cc.SockAddr) ?void {
             return null;
 
         if (net.getsockopt_int(fdobj.fd, c.SOL_SOCKET, c.SO_ERROR, "SO_ERROR")) |err| {
-            if (err == 0) return;
+            if (err == 0) return false;
             cc.set_errno(err);
             return null;
         } else {
@@ -478,6 +480,7 @@ pub fn connect(self: *EvLoop, fdobj: *Fd, addr: *const cc.SockAddr) ?void {
             return null;
         }
     };
+    return true;
 }
 
 pub fn accept(self: *EvLoop, fdobj: *Fd, src_addr: ?*cc.SockAddr) ?c_int {
@@ -523,6 +526,23 @@ pub fn read(self: *EvLoop, fdobj: *Fd, buf: []u8) ReadErr!void {
     }
 }
 
+/// read at least one byte (for stream-based file/socket/pipe)
+pub fn read_some(self: *EvLoop, fdobj: *Fd, buf: []u8) ReadErr!usize {
+    while (!fdobj.is_canceled()) {
+        const n = cc.read(fdobj.fd, buf) orelse {
+            if (cc.errno() != c.EAGAIN)
+                return ReadErr.errno;
+
+            self.add_listener(fdobj, .read, @frame());
+            suspend {}
+            self.del_listener(fdobj, .read, @frame());
+
+            continue;
+        };
+        return if (n > 0) n else ReadErr.eof;
+    } else return ReadErr.errno; // ECANCELED
+}
+
 pub fn read_udp(self: *EvLoop, fdobj: *Fd, buf: []u8, src_addr: ?*cc.SockAddr) ?usize {
     while (!fdobj.is_canceled()) {
         return cc.recvfrom(fdobj.fd, buf, 0, src_addr) orelse {
@@ -538,6 +558,23 @@ pub fn read_udp(self: *EvLoop, fdobj: *Fd, buf: []u8, src_addr: ?*cc.SockAddr) ?
     } else return null;
 }
 
+/// receive as many datagrams as available (at least one) with a single recvmmsg. \
+/// `msgv[i].msg_hdr` is prepared by the caller, `msg_len` is set to the datagram length.
+pub fn read_udp_batch(self: *EvLoop, fdobj: *Fd, msgv: []cc.mmsghdr_t) ?[]cc.mmsghdr_t {
+    while (!fdobj.is_canceled()) {
+        return cc.recvmmsg(fdobj.fd, msgv, 0) orelse {
+            if (cc.errno() != c.EAGAIN)
+                return null;
+
+            self.add_listener(fdobj, .read, @frame());
+            suspend {}
+            self.del_listener(fdobj, .read, @frame());
+
+            continue;
+        };
+    } else return null;
+}
+
 pub fn write(self: *EvLoop, fdobj: *Fd, data: []const u8) ?void {
     var nsend: usize = 0;
 
@@ -0,0 +1,658 @@
+const std = @import("std");
+const g = @import("g.zig");
+const RecvBuf = @import("RecvBuf.zig");
+const testing = std.testing;
+const assert = std.debug.assert;
+
+// ==========================================
+
+/// compact http2 client of the DoH upstream (RFC 8484): POST application/dns-message. \
+/// only the framing, the I/O is done by the tcp/tls session (`Upstream.TCP`). \
+/// the replies are matched by the msg.id (the qid of the session), not by the stream id. \
+/// the peer's MAX_CONCURRENT_STREAMS and send windows are honored: the excess queries are
+/// queued, the DATA is held until the windows allow it (a dns msg is never split). \
+/// the queries not processed by the peer (GOAWAY) are left to the session, resent on reconnect.
+const H2 = @This();
+
+out: std.ArrayListUnmanaged(u8) = .{}, // frames to be written
+flushing: std.ArrayListUnmanaged(u8) = .{}, // frames being written
+streams: std.AutoHashMapUnmanaged(u32, Stream) = .{}, // open streams (request sent or being sent)
+pending: std.ArrayListUnmanaged([]u8) = .{}, // queries beyond the peer's MAX_CONCURRENT_STREAMS (copy)
+done: std.ArrayListUnmanaged(u8) = .{}, // the last complete body, see `next()`
+authority: []const u8 = "",
+path: []const u8 = "",
+next_stream_id: u32 = 1,
+recv_n: u32 = 0, // DATA received since the last connection WINDOW_UPDATE
+send_window: i64 = DEFAULT_WINDOW, // connection send window
+initial_window: i64 = DEFAULT_WINDOW, // send window of a new stream (peer's SETTINGS_INITIAL_WINDOW_SIZE)
+max_streams: u32 = DEFAULT_MAX_STREAMS, // peer's SETTINGS_MAX_CONCURRENT_STREAMS
+blocked_n: u32 = 0, // streams whose DATA waits for the send window
+writing: bool = false, // a coroutine is writing `flushing`
+goaway: bool = false, // no more new streams
+
+const Stream = struct {
+    qid: u16, // msg.id of the query
+    window: i64, // send window
+    data: ?[]u8 = null, // DATA blocked by the send window (copy)
+    headers: bool = false, // the response headers are received
+    status_ok: bool = false, // :status 200
+    body: std.ArrayListUnmanaged(u8) = .{},
+
+    fn deinit(self: *Stream) void {
+        if (self.data) |data| g.allocator.free(data);
+        self.body.deinit(g.allocator);
+    }
+};
+
+/// the result of `next()`
+pub const Response = union(enum) {
+    msg: []const u8, // the body of the response (dns msg)
+    failed: u16, // qid of the query: RST_STREAM or non-200 response
+};
+
+pub const Error = error{Protocol};
+
+/// the receive buffer must hold a frame of the max size
+pub const RECV_BUF_SIZE = FRAME_HEADER_LEN + MAX_FRAME_SIZE;
+
+const PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const FRAME_HEADER_LEN = 9;
+const MAX_FRAME_SIZE = 16384; // SETTINGS_MAX_FRAME_SIZE (default)
+const MAX_WINDOW = std.math.maxInt(u31);
+const DEFAULT_WINDOW = 65535;
+const MAX_STREAM_ID = std.math.maxInt(u31);
+
+/// before the peer's SETTINGS (the recommended minimum, RFC 9113)
+const DEFAULT_MAX_STREAMS = 100;
+
+const FrameType = struct {
+    const DATA = 0;
+    const HEADERS = 1;
+    const RST_STREAM = 3;
+    const SETTINGS = 4;
+    const PUSH_PROMISE = 5;
+    const PING = 6;
+    const GOAWAY = 7;
+    const WINDOW_UPDATE = 8;
+};
+
+const Flag = struct {
+    const END_STREAM = 0x1;
+    const ACK = 0x1;
+    const END_HEADERS = 0x4;
+    const PADDED = 0x8;
+    const PRIORITY = 0x20;
+};
+
+const Setting = struct {
+    const HEADER_TABLE_SIZE = 0x1;
+    const ENABLE_PUSH = 0x2;
+    const MAX_CONCURRENT_STREAMS = 0x3;
+    const INITIAL_WINDOW_SIZE = 0x4;
+};
+
+// ==========================================
+
+pub fn deinit(self: *H2) void {
+    self.reset();
+    self.out.clearAndFree(g.allocator);
+    self.flushing.clearAndFree(g.allocator);
+    self.streams.clearAndFree(g.allocator);
+    self.pending.clearAndFree(g.allocator);
+    self.done.clearAndFree(g.allocator);
+}
+
+/// [connect] a new connection: connection preface + SETTINGS + WINDOW_UPDATE \
+/// `authority`, `path`: of the requests, must outlive the connection
+pub fn start(self: *H2, authority: []const u8, path: []const u8) void {
+    self.reset();
+
+    self.authority = authority;
+    self.path = path;
+
+    self.put(PREFACE);
+
+    // the response headers are never added to the dynamic table,
+    // so the hpack decoder has no state (only :status is needed)
+    self.put_frame_header(12, FrameType.SETTINGS, 0, 0);
+    self.put_setting(Setting.HEADER_TABLE_SIZE, 0);
+    self.put_setting(Setting.ENABLE_PUSH, 0);
+
+    // the connection window is opened to the max, the stream window
+    // (64K by default) is large enough for a dns msg
+    self.put_window_update(MAX_WINDOW - DEFAULT_WINDOW);
+}
+
+fn reset(self: *H2) void {
+    var it = self.streams.valueIterator();
+    while (it.next()) |stream|
+        stream.deinit();
+    self.streams.clearRetainingCapacity();
+
+    for (self.pending.items) |msg|
+        g.allocator.free(msg);
+    self.pending.clearRetainingCapacity();
+
+    self.out.clearRetainingCapacity();
+    self.flushing.clearRetainingCapacity();
+    self.next_stream_id = 1;
+    self.recv_n = 0;
+    self.send_window = DEFAULT_WINDOW;
+    self.initial_window = DEFAULT_WINDOW;
+    self.max_streams = DEFAULT_MAX_STREAMS;
+    self.blocked_n = 0;
+    self.writing = false;
+    self.goaway = false;
+}
+
+/// the POST request of the query, queued if the peer's MAX_CONCURRENT_STREAMS is reached
+/// (or no more streams can be opened, GOAWAY).
+pub fn add_query(self: *H2, msg: []const u8) void {
+    if (self.goaway or self.pending.items.len > 0 or self.streams.count() >= self.max_streams) {
+        const copy = g.allocator.dupe(u8, msg) catch unreachable;
+        self.pending.append(g.allocator, copy) catch unreachable;
+        return;
+    }
+
+    self.open_stream(msg);
+}
+
+/// HEADERS + DATA(END_STREAM), the DATA is held if the send window is not enough
+fn open_stream(self: *H2, msg: []const u8) void {
+    const stream_id = self.next_stream_id;
+    self.next_stream_id += 2;
+
+    // the session should be retired
+    if (self.next_stream_id > MAX_STREAM_ID)
+        self.goaway = true;
+
+    // header block (hpack), the length is filled in later
+    const header_pos = self.out.items.len;
+    self.put_frame_header(0, FrameType.HEADERS, Flag.END_HEADERS, stream_id);
+    const block_pos = self.out.items.len;
+
+    self.put(&[_]u8{ 0x83, 0x87 }); // :method POST, :scheme https
+    self.put_literal(4, self.path); // :path
+    self.put_literal(1, self.authority); // :authority
+    self.put_literal(31, "application/dns-message"); // content-type
+    self.put_literal(19, "application/dns-message"); // accept
+    var buf: [8]u8 = undefined;
+    self.put_literal(28, std.fmt.bufPrint(&buf, "{d}", .{msg.len}) catch unreachable); // content-length
+
+    const block_len = self.out.items.len - block_pos;
+    std.mem.writeIntBig(u24, self.out.items[header_pos..][0..3], @intCast(u24, block_len));
+
+    var stream: Stream = .{ .qid = get_qid(msg), .window = self.initial_window };
+    if (self.can_send(&stream, msg.len)) {
+        self.put_data(&stream, stream_id, msg);
+    } else {
+        stream.data = g.allocator.dupe(u8, msg) catch unreachable;
+        self.blocked_n += 1;
+    }
+    self.streams.putNoClobber(g.allocator, stream_id, stream) catch unreachable;
+}
+
+fn can_send(self: *const H2, stream: *const Stream, len: usize) bool {
+    const n = @intCast(i64, len);
+    return stream.window >= n and self.send_window >= n;
+}
+
+fn put_data(self: *H2, stream: *Stream, stream_id: u32, msg: []const u8) void {
+    self.put_frame_header(msg.len, FrameType.DATA, Flag.END_STREAM, stream_id);
+    self.put(msg);
+    stream.window -= @intCast(i64, msg.len);
+    self.send_window -= @intCast(i64, msg.len);
+}
+
+/// [WINDOW_UPDATE, SETTINGS] send the DATA held by the send window
+fn send_blocked(self: *H2) void {
+    if (self.blocked_n == 0) return;
+
+    var it = self.streams.iterator();
+    while (it.next()) |entry| {
+        const stream = entry.value_ptr;
+        const data = stream.data orelse continue;
+        if (!self.can_send(stream, data.len)) continue;
+
+        self.put_data(stream, entry.key_ptr.*, data);
+        g.allocator.free(data);
+        stream.data = null;
+        self.blocked_n -= 1;
+    }
+}
+
+/// [stream closed, SETTINGS] open the streams of the queued queries
+fn open_pending(self: *H2) void {
+    var n: usize = 0;
+    while (n < self.pending.items.len and !self.goaway and self.streams.count() < self.max_streams) : (n += 1) {
+        const msg = self.pending.items[n];
+        self.open_stream(msg);
+        g.allocator.free(msg);
+    }
+    self.pending.replaceRange(g.allocator, 0, n, &[_][]u8{}) catch unreachable;
+}
+
+/// the stream is closed, a queued query may take its place
+fn remove_stream(self: *H2, stream_id: u32) ?Stream {
+    const kv = self.streams.fetchRemove(stream_id) orelse return null;
+    var stream = kv.value;
+    if (stream.data) |data| {
+        g.allocator.free(data);
+        stream.data = null;
+        self.blocked_n -= 1;
+    }
+    self.open_pending();
+    return stream;
+}
+
+/// msg.id (the qid of the session)
+fn get_qid(msg: []const u8) u16 {
+    return std.mem.readIntNative(u16, msg[0..2]);
+}
+
+/// the frames to be written (null if nothing), valid until the next call
+pub fn take_out(self: *H2) ?[]const u8 {
+    self.flushing.clearRetainingCapacity();
+    if (self.out.items.len == 0)
+        return null;
+    std.mem.swap(std.ArrayListUnmanaged(u8), &self.out, &self.flushing);
+    return self.flushing.items;
+}
+
+// ==========================================
+
+/// process the received frames, return the next complete response (or failed query). \
+/// the body is valid until the next call. the frames to be sent are added to `out`.
+pub fn next(self: *H2, rbuf: *RecvBuf) Error!?Response {
+    while (true) {
+        const data = rbuf.unparsed();
+        if (data.len < FRAME_HEADER_LEN)
+            return null;
+
+        const len = std.mem.readIntBig(u24, data[0..3]);
+        if (len > MAX_FRAME_SIZE)
+            return error.Protocol;
+        if (data.len < FRAME_HEADER_LEN + len)
+            return null;
+
+        rbuf.consume(FRAME_HEADER_LEN + len);
+
+        const frame_type = data[3];
+        const flags = data[4];
+        const stream_id = std.mem.readIntBig(u32, data[5..9]) & MAX_STREAM_ID;
+        const payload = data[FRAME_HEADER_LEN .. FRAME_HEADER_LEN + len];
+
+        if (try self.on_frame(frame_type, flags, stream_id, payload)) |res|
+            return res;
+    }
+}
+
+fn on_frame(self: *H2, frame_type: u8, flags: u8, stream_id: u32, payload: []const u8) Error!?Response {
+    switch (frame_type) {
+        FrameType.DATA => {
+            // flow control counts the whole payload
+            self.recv_n += @intCast(u32, payload.len);
+            if (self.recv_n >= MAX_WINDOW / 2) {
+                self.put_window_update(self.recv_n);
+                self.recv_n = 0;
+            }
+
+            const stream = self.streams.getPtr(stream_id) orelse return null;
+            const data = try unpad(flags, payload);
+            stream.body.appendSlice(g.allocator, data) catch unreachable;
+
+            if (flags & Flag.END_STREAM != 0)
+                return self.end_stream(stream_id);
+        },
+        FrameType.HEADERS => {
+            if (stream_id == 0 or stream_id >= self.next_stream_id)
+                return error.Protocol;
+
+            var block = try unpad(flags, payload);
+            if (flags & Flag.PRIORITY != 0) {
+                if (block.len < 5) return error.Protocol;
+                block = block[5..];
+            }
+
+            // response headers or trailers
+            const stream = self.streams.getPtr(stream_id) orelse return null;
+            if (!stream.headers) {
+                stream.headers = true;
+                stream.status_ok = is_status_ok(block);
+            }
+
+            if (flags & Flag.END_STREAM != 0)
+                return self.end_stream(stream_id);
+        },
+        FrameType.RST_STREAM => {
+            var stream = self.remove_stream(stream_id) orelse return null;
+            stream.deinit();
+            return Response{ .failed = stream.qid };
+        },
+        FrameType.SETTINGS => {
+            if (flags & Flag.ACK != 0)
+                return null;
+            if (payload.len % 6 != 0)
+                return error.Protocol;
+
+            var p = payload;
+            while (p.len > 0) : (p = p[6..]) {
+                const value = std.mem.readIntBig(u32, p[2..6]);
+                switch (std.mem.readIntBig(u16, p[0..2])) {
+                    Setting.MAX_CONCURRENT_STREAMS => self.max_streams = value,
+                    Setting.INITIAL_WINDOW_SIZE => {
+                        if (value > MAX_WINDOW) return error.Protocol;
+                        // applies to the open streams too
+                        const delta = @as(i64, value) - self.initial_window;
+                        var it = self.streams.valueIterator();
+                        while (it.next()) |stream|
+                            stream.window += delta;
+                        self.initial_window = value;
+                    },
+                    else => {},
+                }
+            }
+            self.put_frame_header(0, FrameType.SETTINGS, Flag.ACK, 0);
+
+            self.send_blocked();
+            self.open_pending();
+        },
+        FrameType.WINDOW_UPDATE => {
+            if (payload.len != 4) return error.Protocol;
+            const increment = std.mem.readIntBig(u32, payload[0..4]) & MAX_WINDOW;
+            if (stream_id == 0) {
+                self.send_window += increment;
+            } else if (self.streams.getPtr(stream_id)) |stream| {
+                stream.window += increment;
+            }
+            self.send_blocked();
+        },
+        FrameType.PING => {
+            if (payload.len != 8) return error.Protocol;
+            if (flags & Flag.ACK == 0) {
+                self.put_frame_header(8, FrameType.PING, Flag.ACK, 0);
+                self.put(payload);
+            }
+        },
+        FrameType.GOAWAY => {
+            if (payload.len < 8) return error.Protocol;
+            self.goaway = true;
+
+            // the streams after the last one are not processed by the peer,
+            // their queries are resent in the next connection (still in the ack_list)
+            const last_stream_id = std.mem.readIntBig(u32, payload[0..4]) & MAX_STREAM_ID;
+            var ids: std.ArrayListUnmanaged(u32) = .{};
+            defer ids.deinit(g.allocator);
+            var it = self.streams.keyIterator();
+            while (it.next()) |id| {
+                if (id.* > last_stream_id)
+                    ids.append(g.allocator, id.*) catch unreachable;
+            }
+            for (ids.items) |id| {
+                var stream = self.remove_stream(id).?;
+                stream.deinit();
+            }
+        },
+        FrameType.PUSH_PROMISE => {
+            return error.Protocol; // disabled by SETTINGS
+        },
+        else => {
+            // PRIORITY, CONTINUATION, unknown: ignore
+        },
+    }
+    return null;
+}
+
+/// the response is complete, the query is failed if it is not a dns msg
+fn end_stream(self: *H2, stream_id: u32) ?Response {
+    var stream = self.remove_stream(stream_id) orelse return null;
+    defer stream.deinit();
+
+    if (!stream.status_ok or stream.body.items.len == 0)
+        return Response{ .failed = stream.qid };
+
+    // keep the buffer for the next stream
+    std.mem.swap(std.ArrayListUnmanaged(u8), &self.done, &stream.body);
+    return Response{ .msg = self.done.items };
+}
+
+fn unpad(flags: u8, payload: []const u8) Error![]const u8 {
+    if (flags & Flag.PADDED == 0)
+        return payload;
+    if (payload.len < 1 or payload[0] >= payload.len)
+        return error.Protocol;
+    return payload[1 .. payload.len - payload[0]];
+}
+
+// ==========================================
+
+/// hpack: find the :status in the header block (no dynamic table). \
+/// the block may continue in CONTINUATION frames, :status is always the first field.
+fn is_status_ok(block: []const u8) bool {
+    var p = block;
+    while (p.len > 0) {
+        const b = p[0];
+        if (b & 0x80 != 0) {
+            // indexed field
+            const index = read_int(&p, 7) orelse return false;
+            if (index >= 8 and index <= 14)
+                return index == 8; // :status 200
+        } else if (b & 0xe0 == 0x20) {
+            // dynamic table size update
+            _ = read_int(&p, 5) orelse return false;
+        } else {
+            // literal, with or without indexing
+            const index = if (b & 0x40 != 0)
+                read_int(&p, 6) orelse return false
+            else
+                read_int(&p, 4) orelse return false;
+            const name = if (index == 0) (read_str(&p) orelse return false) else null;
+            const value = read_str(&p) orelse return false;
+            const is_status = if (name) |s| std.mem.eql(u8, s.data, ":status") else index >= 8 and index <= 14;
+            if (is_status) {
+                // "200", huffman: 00010 00000 00000 + EOS padding (1)
+                return if (value.huffman)
+                    std.mem.eql(u8, value.data, "\x10\x01")
+                else
+                    std.mem.eql(u8, value.data, "200");
+            }
+        }
+    }
+    return false;
+}
+
+fn read_int(p: *[]const u8, comptime prefix: u3) ?usize {
+    const max: u8 = (1 << prefix) - 1;
+    const data = p.*;
+    if (data.len == 0) return null;
+
+    var value: usize = data[0] & max;
+    var i: usize = 1;
+    if (value == max) {
+        var shift: u6 = 0;
+        while (true) : (i += 1) {
+            if (i >= data.len or shift > 28) return null;
+            value += @as(usize, data[i] & 0x7f) << shift;
+            shift += 7;
+            if (data[i] & 0x80 == 0) break;
+        }
+        i += 1;
+    }
+    p.* = data[i..];
+    return value;
+}
+
+const Str = struct { data: []const u8, huffman: bool };
+
+fn read_str(p: *[]const u8) ?Str {
+    if (p.len == 0) return null;
+    const huffman = p.*[0] & 0x80 != 0;
+    const len = read_int(p, 7) orelse return null;
+    if (p.len < len) return null;
+    const data = p.*[0..len];
+    p.* = p.*[len..];
+    return Str{ .data = data, .huffman = huffman };
+}
+
+// ==========================================
+
+fn put(self: *H2, data: []const u8) void {
+    self.out.appendSlice(g.allocator, data) catch unreachable;
+}
+
+fn put_byte(self: *H2, b: u8) void {
+    self.out.append(g.allocator, b) catch unreachable;
+}
+
+fn put_frame_header(self: *H2, len: usize, frame_type: u8, flags: u8, stream_id: u32) void {
+    var header: [FRAME_HEADER_LEN]u8 = undefined;
+    std.mem.writeIntBig(u24, header[0..3], @intCast(u24, len));
+    header[3] = frame_type;
+    header[4] = flags;
+    std.mem.writeIntBig(u32, header[5..9], stream_id);
+    self.put(&header);
+}
+
+fn put_setting(self: *H2, id: u16, value: u32) void {
+    var setting: [6]u8 = undefined;
+    std.mem.writeIntBig(u16, setting[0..2], id);
+    std.mem.writeIntBig(u32, setting[2..6], value);
+    self.put(&setting);
+}
+
+/// connection window
+fn put_window_update(self: *H2, increment: u32) void {
+    self.put_frame_header(4, FrameType.WINDOW_UPDATE, 0, 0);
+    var buf: [4]u8 = undefined;
+    std.mem.writeIntBig(u32, &buf, increment);
+    self.put(&buf);
+}
+
+/// hpack integer with the N-bit prefix
+fn put_int(self: *H2, comptime prefix: u3, first: u8, value: usize) void {
+    const max: u8 = (1 << prefix) - 1;
+    if (value < max) {
+        self.put_byte(first | @intCast(u8, value));
+        return;
+    }
+    self.put_byte(first | max);
+    var v = value - max;
+    while (v >= 0x80) : (v >>= 7)
+        self.put_byte(@intCast(u8, v & 0x7f) | 0x80);
+    self.put_byte(@intCast(u8, v));
+}
+
+/// hpack: literal field without indexing, the name is in the static table
+fn put_literal(self: *H2, name_index: usize, value: []const u8) void {
+    self.put_int(4, 0x00, name_index);
+    self.put_int(7, 0x00, value.len); // no huffman
+    self.put(value);
+}
+
+// ==========================================
+
+pub fn @"test: H2"() !void {
+    var h2: H2 = .{};
+    defer h2.deinit();
+
+    h2.start("dns.google", "/dns-query");
+    try testing.expect(std.mem.startsWith(u8, h2.take_out().?, PREFACE));
+    try testing.expect(h2.take_out() == null);
+
+    h2.add_query("\x12\x34query");
+    const req = h2.take_out().?;
+    try testing.expectEqual(@as(u8, FrameType.HEADERS), req[3]);
+    try testing.expectEqual(@as(u32, 1), std.mem.readIntBig(u32, req[5..9]));
+    try testing.expect(std.mem.endsWith(u8, req, "\x12\x34query"));
+    try testing.expectEqual(@as(u32, 3), h2.next_stream_id);
+
+    var rbuf: RecvBuf = .{};
+    defer rbuf.deinit();
+
+    const reply =
+        // SETTINGS
+        "\x00\x00\x00\x04\x00\x00\x00\x00\x00" ++
+        // HEADERS :status 200 (indexed)
+        "\x00\x00\x01\x01\x04\x00\x00\x00\x01\x88" ++
+        // DATA (END_STREAM)
+        "\x00\x00\x08\x00\x01\x00\x00\x00\x01\x12\x34answer" ++
+        // PING
+        "\x00\x00\x08\x06\x00\x00\x00\x00\x00" ++ "12345678";
+
+    // byte by byte
+    var body: ?[]const u8 = null;
+    for (reply) |b| {
+        rbuf.feed(&[_]u8{b});
+        if (try h2.next(&rbuf)) |res| body = res.msg;
+    }
+    try testing.expectEqualStrings("\x12\x34answer", body.?);
+
+    // SETTINGS ACK + PING ACK
+    const ctrl = h2.take_out().?;
+    try testing.expectEqual(@as(usize, FRAME_HEADER_LEN * 2 + 8), ctrl.len);
+    try testing.expectEqual(@as(u8, Flag.ACK), ctrl[4]);
+
+    // :status 404 (literal, huffman) + DATA: not a dns msg
+    h2.add_query("\x00\x01q");
+    rbuf.feed("\x00\x00\x05\x01\x04\x00\x00\x00\x03\x08\x83\x68\x0d\x7f");
+    rbuf.feed("\x00\x00\x01\x00\x01\x00\x00\x00\x03x");
+    const res = (try h2.next(&rbuf)).?;
+    try testing.expectEqual(std.mem.readIntNative(u16, "\x00\x01"), res.failed);
+    try testing.expect((try h2.next(&rbuf)) == null);
+
+    try testing.expect(is_status_ok("\x08\x82\x10\x01"));
+    try testing.expect(!is_status_ok("\x08\x83\x68\x0d\x7f")); // "404"
+    // RFC 7541 C.6.1: literal with indexing, :status "302" (huffman)
+    try testing.expect(!is_status_ok("\x48\x82\x64\x02"));
+    try testing.expect(is_status_ok("\x08\x03200"));
+    try testing.expect(!is_status_ok("\x8d"));
+}
+
+pub fn @"test: H2 flow control"() !void {
+    var h2: H2 = .{};
+    defer h2.deinit();
+
+    h2.start("dns.google", "/dns-query");
+    _ = h2.take_out();
+
+    var rbuf: RecvBuf = .{};
+    defer rbuf.deinit();
+
+    // SETTINGS: MAX_CONCURRENT_STREAMS 1, INITIAL_WINDOW_SIZE 4
+    rbuf.feed("\x00\x00\x0c\x04\x00\x00\x00\x00\x00" ++ "\x00\x03\x00\x00\x00\x01" ++ "\x00\x04\x00\x00\x00\x04");
+    try testing.expect((try h2.next(&rbuf)) == null);
+    try testing.expectEqual(@as(u32, 1), h2.max_streams);
+    _ = h2.take_out(); // SETTINGS ACK
+
+    // HEADERS only, the DATA exceeds the stream window
+    h2.add_query("\x00\x01query");
+    try testing.expectEqual(@as(u8, FrameType.HEADERS), h2.take_out().?[3]);
+    try testing.expectEqual(@as(u32, 1), h2.blocked_n);
+
+    // queued, beyond the concurrency limit
+    h2.add_query("\x00\x02query");
+    try testing.expect(h2.take_out() == null);
+    try testing.expectEqual(@as(usize, 1), h2.pending.items.len);
+
+    // WINDOW_UPDATE of stream 1: the DATA is sent
+    rbuf.feed("\x00\x00\x04\x08\x00\x00\x00\x00\x01\x00\x00\x00\x10");
+    try testing.expect((try h2.next(&rbuf)) == null);
+    const data = h2.take_out().?;
+    try testing.expectEqual(@as(u8, FrameType.DATA), data[3]);
+    try testing.expect(std.mem.endsWith(u8, data, "\x00\x01query"));
+    try testing.expectEqual(@as(u32, 0), h2.blocked_n);
+
+    // RST_STREAM of stream 1: failed, the queued query takes its place
+    rbuf.feed("\x00\x00\x04\x03\x00\x00\x00\x00\x01\x00\x00\x00\x07");
+    const res = (try h2.next(&rbuf)).?;
+    try testing.expectEqual(std.mem.readIntNative(u16, "\x00\x01"), res.failed);
+    try testing.expectEqual(@as(usize, 0), h2.pending.items.len);
+    const req = h2.take_out().?;
+    try testing.expectEqual(@as(u32, 3), std.mem.readIntBig(u32, req[5..9]));
+
+    // GOAWAY: stream 3 is not processed, left to the session
+    rbuf.feed("\x00\x00\x08\x07\x00\x00\x00\x00\x00\x00\x00\x00\x01\x00\x00\x00\x00");
+    try testing.expect((try h2.next(&rbuf)) == null);
+    try testing.expect(h2.goaway);
+    try testing.expectEqual(@as(u32, 0), h2.streams.count());
+}
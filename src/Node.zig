@@ -103,6 +103,14 @@ pub fn move_to_tail(list: *Node, node: *Node) void {
     }
 }
 
+/// insert the timer (`T.node`, `T.deadline`) in the order of deadline, usually at the tail
+pub fn link_by_deadline(list: *Node, comptime T: type, timer: *T) void {
+    var prev = list.tail();
+    while (prev != list and T.from_node(prev).deadline > timer.deadline)
+        prev = prev.prev;
+    prev.link_to_head(&timer.node);
+}
+
 fn link(node: *Node, prev: *Node, next: *Node) void {
     prev.next = node;
     node.prev = prev;
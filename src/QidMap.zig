@@ -0,0 +1,111 @@
+const std = @import("std");
+const g = @import("g.zig");
+const testing = std.testing;
+const assert = std.debug.assert;
+
+// ==========================================
+
+/// qid space of an upstream session: qid(msg.id) => pending query. \
+/// each session allocates its own qids, so the number of pending queries
+/// is limited per session rather than globally.
+const QidMap = @This();
+
+map: std.AutoHashMapUnmanaged(u16, Pending) = .{},
+last_qid: u16 = 0,
+
+/// handle of the pending query (see `server.Query.List`) \
+/// `gen` is bumped when the slot is reused, so a late reply can't match another query
+pub const QueryKey = struct {
+    idx: u32, // slot index
+    gen: u32, // slot generation
+};
+
+/// the pending query of the qid
+pub const Pending = struct {
+    key: QueryKey,
+    rtt: bool = true, // the reply is a valid rtt sample (not delayed by the connect, not a retransmission)
+};
+
+/// must <= u16_max + 1
+pub const MAX = std.math.maxInt(u16) + 1;
+
+// ==========================================
+
+pub fn deinit(self: *QidMap) void {
+    self.map.clearAndFree(g.allocator);
+}
+
+pub fn count(self: *const QidMap) usize {
+    return self.map.count();
+}
+
+pub fn is_full(self: *const QidMap) bool {
+    return self.count() >= MAX;
+}
+
+/// allocate a qid for the query (null if the qid space is exhausted)
+pub fn add(self: *QidMap, key: QueryKey) ?u16 {
+    if (self.is_full())
+        return null;
+
+    // qids are allocated in order, so the next one is usually free
+    while (true) {
+        self.last_qid +%= 1;
+        const res = self.map.getOrPut(g.allocator, self.last_qid) catch unreachable;
+        if (!res.found_existing) {
+            res.value_ptr.* = .{ .key = key };
+            return self.last_qid;
+        }
+    }
+}
+
+/// the reply of the qid is not a valid rtt sample
+pub fn no_rtt(self: *QidMap, qid: u16) void {
+    if (self.map.getPtr(qid)) |pending|
+        pending.rtt = false;
+}
+
+/// [reconnect] the replies of the outstanding queries are not valid rtt samples
+pub fn no_rtt_all(self: *QidMap) void {
+    var it = self.map.valueIterator();
+    while (it.next()) |pending|
+        pending.rtt = false;
+}
+
+/// [on_reply] qid => pending query
+pub fn remove(self: *QidMap, qid: u16) ?Pending {
+    const kv = self.map.fetchRemove(qid) orelse return null;
+    return kv.value;
+}
+
+/// remove all qids (the queries are abandoned)
+pub fn clear(self: *QidMap) void {
+    self.map.clearRetainingCapacity();
+}
+
+// ==========================================
+
+pub fn @"test: QidMap"() !void {
+    var qids: QidMap = .{};
+    defer qids.deinit();
+
+    const q1 = qids.add(.{ .idx = 1, .gen = 0 }).?;
+    const q2 = qids.add(.{ .idx = 2, .gen = 0 }).?;
+    try testing.expect(q1 != q2);
+    try testing.expectEqual(@as(usize, 2), qids.count());
+
+    try testing.expectEqual(@as(u32, 1), qids.remove(q1).?.key.idx);
+    try testing.expect(qids.remove(q1) == null);
+
+    // wrap around, skip the qid in use
+    qids.last_qid = q2 - 1;
+    const q3 = qids.add(.{ .idx = 3, .gen = 1 }).?;
+    try testing.expect(q3 != q2);
+    qids.no_rtt(q3);
+    const p2 = qids.remove(q2).?;
+    try testing.expectEqual(@as(u32, 2), p2.key.idx);
+    try testing.expect(p2.rtt);
+    const p3 = qids.remove(q3).?;
+    try testing.expectEqual(@as(u32, 1), p3.key.gen);
+    try testing.expect(!p3.rtt);
+}
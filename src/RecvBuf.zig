@@ -0,0 +1,126 @@
+const std = @import("std");
+const g = @import("g.zig");
+const testing = std.testing;
+const assert = std.debug.assert;
+
+// ==========================================
+
+/// receive buffer of the dns stream (tcp/tls): {len(be16), msg}... \
+/// read as much as available at once, then parse all the complete msgs out of it.
+const RecvBuf = @This();
+
+buf: []u8 = &.{},
+start: usize = 0, // start of the unparsed data
+end: usize = 0, // end of the received data
+
+/// initial capacity (enough for most replies)
+const INIT_SIZE = 2048;
+
+// ==========================================
+
+pub fn deinit(self: *RecvBuf) void {
+    if (self.buf.len > 0)
+        g.allocator.free(self.buf);
+    self.* = .{};
+}
+
+/// no unparsed data
+pub fn is_empty(self: *const RecvBuf) bool {
+    return self.start == self.end;
+}
+
+/// length of the incomplete msg (its length field has been received)
+pub fn pending_len(self: *const RecvBuf) ?u16 {
+    const data = self.buf[self.start..self.end];
+    if (data.len < 2) return null;
+    return std.mem.readIntBig(u16, data[0..2]);
+}
+
+/// return the next complete msg (without the length field). \
+/// the msg is valid until the next call of `space()`.
+pub fn next(self: *RecvBuf) ?[]u8 {
+    const len = self.pending_len() orelse return null;
+    const data = self.buf[self.start..self.end];
+    if (data.len < 2 + len) return null;
+    self.start += 2 + len;
+    return data[2 .. 2 + len];
+}
+
+/// the free space for receiving, then call `commit(n)`. \
+/// the buffer will be compacted or expanded to fit the incomplete msg.
+pub fn space(self: *RecvBuf) []u8 {
+    var size: usize = INIT_SIZE;
+    if (self.pending_len()) |len|
+        size = std.math.max(size, 2 + @as(usize, len));
+    return self.space_n(size);
+}
+
+/// like `space()`, but the buffer is expanded to `size` (for the non-dns stream, e.g. http2 frames)
+pub fn space_n(self: *RecvBuf, size: usize) []u8 {
+    // move the unparsed data to the front
+    if (self.start > 0) {
+        std.mem.copy(u8, self.buf, self.buf[self.start..self.end]);
+        self.end -= self.start;
+        self.start = 0;
+    }
+
+    if (self.buf.len < size)
+        self.buf = g.allocator.realloc(self.buf, size) catch unreachable;
+
+    assert(self.end < self.buf.len);
+    return self.buf[self.end..];
+}
+
+/// `n` bytes have been received into `space()`
+pub fn commit(self: *RecvBuf, n: usize) void {
+    assert(self.end + n <= self.buf.len);
+    self.end += n;
+}
+
+/// the unparsed data, for the non-dns stream (see `space_n()`)
+pub fn unparsed(self: *const RecvBuf) []u8 {
+    return self.buf[self.start..self.end];
+}
+
+/// `n` bytes of `unparsed()` have been parsed
+pub fn consume(self: *RecvBuf, n: usize) void {
+    assert(self.start + n <= self.end);
+    self.start += n;
+}
+
+// ==========================================
+
+/// for tests
+pub fn feed(self: *RecvBuf, data: []const u8) void {
+    const buf = self.space();
+    assert(data.len <= buf.len);
+    std.mem.copy(u8, buf, data);
+    self.commit(data.len);
+}
+
+pub fn @"test: RecvBuf"() !void {
+    var rbuf: RecvBuf = .{};
+    defer rbuf.deinit();
+
+    // two complete msgs and a partial one
+    rbuf.feed("\x00\x03abc\x00\x02de\x00\x04fg");
+    try testing.expectEqualStrings("abc", rbuf.next().?);
+    try testing.expectEqualStrings("de", rbuf.next().?);
+    try testing.expect(rbuf.next() == null);
+    try testing.expectEqual(@as(?u16, 4), rbuf.pending_len());
+
+    // the rest of the partial msg
+    rbuf.feed("hi");
+    try testing.expectEqualStrings("fghi", rbuf.next().?);
+    try testing.expect(rbuf.next() == null);
+    try testing.expect(rbuf.pending_len() == null);
+
+    // larger than the initial capacity
+    var big: [2 + INIT_SIZE * 2]u8 = undefined;
+    std.mem.writeIntBig(u16, big[0..2], INIT_SIZE * 2);
+    std.mem.set(u8, big[2..], 'x');
+    rbuf.feed(big[0..INIT_SIZE]);
+    try testing.expect(rbuf.next() == null);
+    rbuf.feed(big[INIT_SIZE..]);
+    try testing.expectEqual(@as(usize, INIT_SIZE * 2), rbuf.next().?.len);
+}
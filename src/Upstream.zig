@@ -9,11 +9,17 @@ const net = @import("net.zig");
 const dns = @import("dns.zig");
 const log = @import("log.zig");
 const server = @import("server.zig");
+const groups = @import("groups.zig");
 const Tag = @import("tag.zig").Tag;
 const EvLoop = @import("EvLoop.zig");
 const RcMsg = @import("RcMsg.zig");
+const RecvBuf = @import("RecvBuf.zig");
+const H2 = @import("H2.zig");
 const Node = @import("Node.zig");
+const QidMap = @import("QidMap.zig");
+const QueryKey = QidMap.QueryKey;
 const str2int = @import("str2int.zig");
+const stats = @import("stats.zig");
 const assert = std.debug.assert;
 
 // ======================================================
@@ -31,28 +37,102 @@ comptime {
 const Upstream = @This();
 
 // session
-session: ?*anyopaque = null, // `struct UDP` or `struct TCP`
+tcp_pool: [TCP_POOL_MAX]?*TCP = [_]?*TCP{null} ** TCP_POOL_MAX, // `struct TCP`, the first `conns` are used
+tcp_next: [TCP_POOL_MAX]?*TCP = [_]?*TCP{null} ** TCP_POOL_MAX, // [warm] connecting, to take over tcp_pool[i]
+warm_time: u64 = 0, // [warm] time of the next check
+udp_pool: [UDP_POOL_N]?*UDP = [_]?*UDP{null} ** UDP_POOL_N, // `struct UDP`
+udp_next: u8 = 0, // round-robin index of udp_pool
+udp_rotating: bool = false, // in _rotate_list
+udp_rotate_time: u64 = 0, // the next expired socket of udp_pool can be replaced (ms)
+tls_cache: TLSCache_ = .{}, // DoT/DoH session resumption
 
 // config
-host: ?cc.ConstStr, // DoT SNI
+host: ?cc.ConstStr, // DoT/DoH SNI (and the :authority of DoH)
+path: ?cc.ConstStr, // DoH request path
 url: cc.ConstStr, // for printing
 addr: cc.SockAddr,
 count: ParamValue, // max queries per session (0 means no limit)
 life: ParamValue, // max lifetime(sec) per session (0 means no limit)
+conns: ParamValue, // number of concurrent tcp/tls sessions
 proto: Proto,
 tag: Tag,
 
+// rtt estimate (`--upstream-best`, `--upstream-hedge`)
+srtt: u32 = 0, // smoothed rtt(ms), 0 means not measured yet
+rttvar: u32 = 0, // rtt variation(ms)
+unanswered: u32 = 0, // queries sent since the last reply
+unanswered_since: u64 = 0, // time of the first unanswered query
+sent_n: u64 = 0, // total queries sent
+reply_n: u64 = 0, // total replies received
+loss: u16 = 0, // [udp] rate of the rto expirations, EWMA in 1/LOSS_ONE
+
+// circuit breaker
+circuit: Circuit = .closed,
+probe_time: u64 = 0, // [open] time of the next probe
+probe_interval: u32 = 0, // [open] ms, doubled after each unanswered probe
+
 const ParamValue = u16;
 const DEFAULT_COUNT: ParamValue = 10;
 const DEFAULT_LIFE: ParamValue = 10;
+const DEFAULT_CONNS: ParamValue = 1;
+
+/// max number of tcp/tls sessions per upstream (`?conns=N`)
+const TCP_POOL_MAX = 8;
+
+/// number of udp sockets per upstream
+const UDP_POOL_N = 4;
+
+/// request path of DoH (RFC 8484)
+const DEFAULT_PATH = "/dns-query";
+
+/// rto before the first rtt sample (ms)
+const RTO_INIT = 1000;
+
+/// lower bound of the rto (ms), the rtt of a cache miss varies a lot
+const RTO_MIN = 100;
+
+/// max number of retransmissions per udp query
+const RETRANSMIT_MAX = 2;
+
+/// fixed-point 1.0 of `loss`
+const LOSS_ONE = 1024;
+
+/// consecutive unanswered queries (while failing) to open the circuit
+const CIRCUIT_FAIL_N = 5;
+
+/// interval of the health probes (ms)
+const PROBE_MIN_INTERVAL = 1000;
+const PROBE_MAX_INTERVAL = 30 * 1000;
+
+/// [`--upstream-warm`] interval of the pool check (ms), also the retry interval of a failed connect
+const WARM_INTERVAL = 1000;
+
+/// [`--upstream-warm`] connect the replacement this long before the session reaches its `life` (ms)
+const WARM_LEAD = 2000;
+
+/// [`--edns-keepalive`] close the idle session this long before the idle timeout of the upstream (ms)
+const KEEPALIVE_MARGIN = 1000;
+
+/// the probe is not a pending query, its reply is just ignored by `server.on_reply`
+const PROBE_KEY: QueryKey = .{ .idx = std.math.maxInt(u32), .gen = 0 };
+
+/// ". IN NS" with RD, usually answered from the cache of the upstream
+const PROBE_MSG = "\x00\x00\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00" ++ "\x00\x00\x02\x00\x01";
+
+pub const Circuit = enum {
+    closed, // in rotation
+    open, // out of rotation, probed in the background
+    half_open, // the probe has been sent, closed by any reply
+};
 
 // ======================================================
 
 /// for `Group.do_add` (at startup)
-fn eql(self: *const Upstream, proto: Proto, addr: *const cc.SockAddr, host: []const u8) bool {
+fn eql(self: *const Upstream, proto: Proto, addr: *const cc.SockAddr, host: []const u8, path: []const u8) bool {
     return self.proto == proto and
         self.addr.eql(addr) and
-        std.mem.eql(u8, cc.strslice_c(self.host orelse ""), host);
+        std.mem.eql(u8, cc.strslice_c(self.host orelse ""), host) and
+        std.mem.eql(u8, cc.strslice_c(self.path orelse ""), path);
 }
 
 /// for `Group.do_add` (at startup)
@@ -61,16 +141,23 @@ fn init(
     proto: Proto,
     addr: *const cc.SockAddr,
     host: []const u8,
+    path: []const u8,
     ip: []const u8,
     port: u16,
     count: ParamValue,
     life: ParamValue,
+    conns: ParamValue,
 ) Upstream {
     const dupe_host: ?cc.ConstStr = if (host.len > 0)
         (g.allocator.dupeZ(u8, host) catch unreachable).ptr
     else
         null;
 
+    const dupe_path: ?cc.ConstStr = if (path.len > 0)
+        (g.allocator.dupeZ(u8, path) catch unreachable).ptr
+    else
+        null;
+
     var portbuf: [10]u8 = undefined;
     const url = cc.to_cstr_x(&.{
         // tcp://
@@ -82,6 +169,8 @@ fn init(
         ip,
         // #port
         cc.b2v(proto.is_std_port(port), "", cc.snprintf(&portbuf, "#%u", .{cc.to_uint(port)})),
+        // /path
+        path,
     });
     const dupe_url = (g.allocator.dupeZ(u8, cc.strslice_c(url)) catch unreachable).ptr;
 
@@ -90,49 +179,368 @@ fn init(
         .proto = proto,
         .addr = addr.*,
         .host = dupe_host,
+        .path = dupe_path,
         .url = dupe_url,
         .count = count,
         .life = life,
+        .conns = conns,
     };
 }
 
 /// for `Group.rm_useless` (at startup)
 fn deinit(self: *const Upstream) void {
-    assert(self.session == null);
+    for (self.tcp_pool) |s| assert(s == null);
+    for (self.udp_pool) |s| assert(s == null);
 
     if (self.host) |host|
         g.allocator.free(cc.strslice_c(host));
 
+    if (self.path) |path|
+        g.allocator.free(cc.strslice_c(path));
+
     g.allocator.free(cc.strslice_c(self.url));
 }
 
 // ======================================================
 
-/// [nosuspend] send query to upstream
-fn send(self: *Upstream, qmsg: *RcMsg) void {
+/// [nosuspend] send query to upstream \
+/// `retransmit`: the query has been sent before (its reply is not a valid rtt sample)
+fn send(self: *Upstream, qmsg: *RcMsg, qkey: QueryKey, retransmit: bool) void {
+    if (self.unanswered == 0)
+        self.unanswered_since = g.evloop.time;
+    self.unanswered +|= 1;
+    self.sent_n += 1;
+
+    if (self.circuit == .closed and self.unanswered >= CIRCUIT_FAIL_N and self.is_failing())
+        self.open_circuit();
+
     nosuspend switch (self.proto) {
-        .udpi, .udp => if (self.udp_session()) |s| s.send_query(qmsg),
-        .tcpi, .tcp, .tls => if (self.tcp_session()) |s| s.send_query(qmsg),
+        .udpi, .udp => if (self.udp_session()) |s| s.send_query(qmsg, qkey, retransmit),
+        .tcpi, .tcp, .tls, .https => if (self.tcp_session()) |s| s.send_query(qmsg, qkey, retransmit),
         else => unreachable,
     };
 }
 
+/// pick a pooled socket (round-robin), so that each socket has its own qid space. \
+/// the expired sockets are replaced in the background (see `rotate_udp_pool`).
 fn udp_session(self: *Upstream) ?*UDP {
-    return self.get_session(UDP);
+    var i: u8 = 0;
+    while (i < UDP_POOL_N) : (i += 1) {
+        const idx = (self.udp_next + i) % UDP_POOL_N;
+        const s = self.udp_pool[idx] orelse {
+            self.rotate_udp_pool();
+            continue;
+        };
+        if (s.qids.is_full())
+            continue;
+        // keep using it until it is replaced
+        if (s.is_expired())
+            self.rotate_udp_pool();
+        self.udp_next = (idx + 1) % UDP_POOL_N;
+        return s;
+    }
+
+    // the pool is empty (first query) or all sockets are full
+    const s = UDP.new(self) orelse return null;
+    self.set_udp_pool(self.udp_next, s);
+    self.rotate_udp_pool();
+    return s;
 }
 
+/// put the socket into the pool, the old one is retired
+fn set_udp_pool(self: *Upstream, idx: usize, session: *UDP) void {
+    const old = self.udp_pool[idx];
+    self.udp_pool[idx] = session;
+    session.pooled = true;
+
+    if (old) |s|
+        s.retire();
+}
+
+/// [nosuspend] the socket is freed, remove it from the pool
+fn del_udp_pool(self: *Upstream, session: *const UDP) void {
+    for (self.udp_pool) |*p_s| {
+        if (p_s.* == session)
+            p_s.* = null;
+    }
+    self.rotate_udp_pool();
+}
+
+/// fill the empty slots and replace the expired sockets at the next check_timeout
+fn rotate_udp_pool(self: *Upstream) void {
+    if (self.udp_rotating) return;
+    self.udp_rotating = true;
+    _rotate_list.append(g.allocator, self) catch unreachable;
+}
+
+/// [check_timeout] create new sockets off the query path. \
+/// the expired sockets are replaced one at a time, every `life / UDP_POOL_N` seconds.
+fn do_rotate_udp_pool(self: *Upstream) void {
+    self.udp_rotating = false;
+
+    for (self.udp_pool) |session, idx| {
+        if (session) |s| {
+            if (!s.is_expired() or g.evloop.time < self.udp_rotate_time) continue;
+            self.udp_rotate_time = g.evloop.time + cc.to_u64(self.life) * 1000 / UDP_POOL_N;
+        }
+        const new_session = UDP.new(self) orelse return;
+        self.set_udp_pool(idx, new_session);
+    }
+}
+
+/// least-pending dispatch over the `conns` sessions. \
+/// each session reconnects on its own, so a slow reply or a reconnect
+/// only stalls the queries of that session.
 fn tcp_session(self: *Upstream) ?*TCP {
-    return self.get_session(TCP);
+    var best: ?*TCP = null;
+    var empty_idx: ?usize = null;
+
+    for (self.tcp_pool[0..self.conns]) |session, idx| {
+        if (session) |s| {
+            if (!s.is_retire() and !s.qids.is_full()) {
+                if (best == null or s.qids.count() < best.?.qids.count())
+                    best = s;
+                continue;
+            }
+            self.del_tcp_pool(s);
+            if (s.is_idle())
+                s.free();
+        }
+        if (empty_idx == null)
+            empty_idx = idx;
+    }
+
+    // open a new connection rather than queue behind the pending queries
+    if (best) |s| {
+        if (s.is_idle() or empty_idx == null)
+            return s;
+    }
+
+    const s = TCP.new(self);
+    s.pooled = true;
+    self.tcp_pool[empty_idx.?] = s;
+    return s;
+}
+
+/// the session is retired or freed
+fn del_tcp_pool(self: *Upstream, session: *TCP) void {
+    if (!session.pooled) return;
+    session.pooled = false;
+
+    for (self.tcp_pool) |*p_s| {
+        if (p_s.* == session)
+            p_s.* = null;
+    }
+}
+
+/// [`--upstream-warm`] for `groups.on_start`: the sessions are connected at the first check_timeout
+pub fn warm_up(self: *Upstream) void {
+    if (self.proto.is_udp()) {
+        self.rotate_udp_pool();
+    } else {
+        _warm_list.append(g.allocator, self) catch unreachable;
+    }
+}
+
+/// [check_timeout] keep `conns` connected sessions in the pool. \
+/// the replacement of a retiring session is connected in the background,
+/// and takes over its slot once connected (make-before-break).
+fn keep_warm(self: *Upstream, timer: *EvLoop.Timer) void {
+    // down: probed instead
+    if (self.circuit != .closed or !timer.check_deadline(self.warm_time))
+        return;
+
+    var started = false;
+
+    for (self.tcp_pool[0..self.conns]) |session, idx| {
+        if (self.tcp_next[idx] != null)
+            continue;
+
+        if (session) |s| {
+            if (s.fdobj == null and s.is_idle()) {
+                // closed by the upstream (idle timeout)
+                s.start();
+                started = true;
+            } else if (s.is_retiring()) {
+                const next = TCP.new(self);
+                next.flags.warming = true;
+                self.tcp_next[idx] = next;
+                next.start();
+                started = true;
+            } else if (s.retire_time()) |t| {
+                _ = timer.check_deadline(t -| WARM_LEAD);
+            }
+        } else {
+            const s = TCP.new(self);
+            s.pooled = true;
+            self.tcp_pool[idx] = s;
+            s.start();
+            started = true;
+        }
+    }
+
+    if (started) {
+        self.warm_time = g.evloop.time + WARM_INTERVAL;
+        _ = timer.check_deadline(self.warm_time);
+    }
+}
+
+/// [`--upstream-warm`] the replacement is connected, retire the old session of the slot
+fn on_warm(self: *Upstream, session: *TCP) void {
+    session.flags.warming = false;
+
+    for (self.tcp_next) |*p_s, idx| {
+        if (p_s.* != session) continue;
+        p_s.* = null;
+
+        if (self.tcp_pool[idx]) |old| {
+            self.del_tcp_pool(old);
+            if (old.is_idle())
+                old.free();
+        }
+
+        session.pooled = true;
+        self.tcp_pool[idx] = session;
+        return;
+    }
+}
+
+/// [`--upstream-warm`] the replacement failed to connect (or is freed)
+fn del_tcp_next(self: *Upstream, session: *const TCP) void {
+    for (self.tcp_next) |*p_s| {
+        if (p_s.* == session)
+            p_s.* = null;
+    }
+}
+
+// ======================================================
+
+/// the session received a reply
+fn on_answer(self: *Upstream) void {
+    self.unanswered = 0;
+    self.reply_n += 1;
+
+    if (self.circuit != .closed)
+        self.close_circuit();
+}
+
+/// silently dropping the queries: out of rotation until a probe is answered
+fn open_circuit(self: *Upstream) void {
+    log.warn(@src(), "upstream %s is down (%u queries unanswered), open the circuit", .{ self.url, cc.to_uint(self.unanswered) });
+    stats.circuit_opens += 1;
+
+    self.circuit = .open;
+    self.probe_interval = PROBE_MIN_INTERVAL;
+    self.probe_time = g.evloop.time + self.probe_interval;
+
+    // may not be removed yet (closed recently)
+    if (std.mem.indexOfScalar(*Upstream, _open_list.items, self) == null)
+        _open_list.append(g.allocator, self) catch unreachable;
+}
+
+/// [on_answer] back in rotation (removed from `_open_list` by check_timeout)
+fn close_circuit(self: *Upstream) void {
+    log.info(@src(), "upstream %s is up, close the circuit", .{self.url});
+    self.circuit = .closed;
+}
+
+/// [check_timeout] send a lightweight query, the interval is doubled until it is answered
+fn probe(self: *Upstream) void {
+    self.circuit = .half_open;
+    self.probe_interval = std.math.min(self.probe_interval * 2, PROBE_MAX_INTERVAL);
+    self.probe_time = g.evloop.time + self.probe_interval;
+
+    const qmsg = RcMsg.new(PROBE_MSG.len);
+    defer qmsg.unref();
+    qmsg.len = PROBE_MSG.len;
+    @memcpy(qmsg.msg().ptr, PROBE_MSG, PROBE_MSG.len);
+
+    stats.probes += 1;
+    nosuspend self.send(qmsg, PROBE_KEY, false);
+}
+
+/// [on_reply] `rtt`: time since the query was received (ms)
+pub fn on_rtt(self: *Upstream, rtt: u64) void {
+    const sample = cc.to_u32(std.math.clamp(rtt, 1, std.math.maxInt(u32) / 8));
+
+    if (self.srtt == 0) {
+        self.srtt = sample;
+        self.rttvar = sample / 2;
+        return;
+    }
+
+    // RFC 6298: rttvar = 3/4 * rttvar + 1/4 * |srtt - sample|, srtt = 7/8 * srtt + 1/8 * sample
+    const delta = if (self.srtt > sample) self.srtt - sample else sample - self.srtt;
+    self.rttvar = self.rttvar - self.rttvar / 4 + delta / 4;
+    self.srtt = self.srtt - self.srtt / 8 + sample / 8;
+}
+
+/// retransmission timeout (ms): srtt + 4 * rttvar (RFC 6298), at most `timeout-sec`
+fn rto(self: *const Upstream) u64 {
+    if (self.srtt == 0)
+        return RTO_INIT;
+    const value = cc.to_u64(self.srtt) + cc.to_u64(self.rttvar) * 4;
+    return std.math.clamp(value, RTO_MIN, cc.to_u64(g.upstream_timeout) * 1000);
+}
+
+/// [udp] `lost`: the rto expired without reply (otherwise a reply is received)
+fn on_loss(self: *Upstream, lost: bool) void {
+    // EWMA: 7/8 old + 1/8 sample (rounded up, so that it can reach 0 and LOSS_ONE)
+    if (lost)
+        self.loss += (LOSS_ONE - self.loss + 7) / 8
+    else
+        self.loss -= (self.loss + 7) / 8;
+}
+
+/// [udp] copies of the query to the trust upstream, at most `--repeat-times`: \
+/// just enough to make the loss of all the copies rare (< 1%).
+fn packet_n(self: *const Upstream) u8 {
+    if (self.tag != .gfw)
+        return 1;
+
+    var n: u8 = 1;
+    var all_lost: u32 = self.loss;
+    while (n < g.trustdns_packet_n and all_lost * 100 >= LOSS_ONE) : (n += 1)
+        all_lost = all_lost * self.loss / LOSS_ONE;
+    return n;
+}
+
+/// roughly the p95 rtt (ms): srtt + 2 * rttvar
+fn hedge_delay(self: *const Upstream) u64 {
+    return std.math.max(cc.to_u64(self.srtt) + cc.to_u64(self.rttvar) * 2, HEDGE_MIN_DELAY);
 }
 
-fn get_session(self: *Upstream, comptime T: type) ?*T {
-    if (self.session == null)
-        self.session = T.new(self);
-    return cc.ptrcast(?*T, self.session);
+/// no reply for a while (much longer than the usual rtt)
+fn is_failing(self: *const Upstream) bool {
+    if (self.unanswered == 0)
+        return false;
+    const max_wait = std.math.clamp(cc.to_u64(self.srtt) * 4, 500, cc.to_u64(g.upstream_timeout) * 1000);
+    return g.evloop.time >= self.unanswered_since + max_wait;
 }
 
-fn session_eql(self: *const Upstream, in_session: ?*const anyopaque) bool {
-    return self.session == in_session;
+/// accept the query from udp(`udpi=true`) or tcp(`udpi=false`)
+fn accept_from(self: *const Upstream, udpi: bool) bool {
+    return switch (self.proto) {
+        .udpi => udpi,
+        .tcpi => !udpi,
+        else => true,
+    };
+}
+
+/// SIGUSR1
+pub fn dump_stats(self: *const Upstream) void {
+    log.info(@src(), "upstream %s circuit:%s srtt:%ums rttvar:%ums rto:%llums loss:%.2f%% sent:%llu replies:%llu unanswered:%u%s", .{
+        self.url,
+        @tagName(self.circuit).ptr,
+        cc.to_uint(self.srtt),
+        cc.to_uint(self.rttvar),
+        cc.to_ulonglong(self.rto()),
+        @intToFloat(f64, self.loss) * 100 / LOSS_ONE,
+        cc.to_ulonglong(self.sent_n),
+        cc.to_ulonglong(self.reply_n),
+        cc.to_uint(self.unanswered),
+        cc.b2s(self.is_failing(), " [failing]", ""),
+    });
 }
 
 // ======================================================
@@ -140,11 +548,81 @@ fn session_eql(self: *const Upstream, in_session: ?*const anyopaque) bool {
 /// for check_timeout (response timeout)
 var _session_list: Node = undefined;
 
+/// for check_timeout (hedge timer), sorted by deadline
+var _hedge_list: Node = undefined;
+
+/// for check_timeout (retransmission timer), sorted by deadline
+var _retransmit_list: Node = undefined;
+
+/// for check_timeout (udp socket pool)
+var _rotate_list: std.ArrayListUnmanaged(*Upstream) = .{};
+
+/// for check_timeout (health probe), the upstreams whose circuit is not closed
+var _open_list: std.ArrayListUnmanaged(*Upstream) = .{};
+
+/// for check_timeout (`--upstream-warm`), the tcp/tls upstreams
+var _warm_list: std.ArrayListUnmanaged(*Upstream) = .{};
+
 pub fn module_init() void {
     _session_list.init();
+    _hedge_list.init();
+    _retransmit_list.init();
+}
+
+pub fn module_deinit() void {
+    _recv_batch.deinit();
+    _rotate_list.clearAndFree(g.allocator);
+    _open_list.clearAndFree(g.allocator);
+    _warm_list.clearAndFree(g.allocator);
+
+    var it = _hedge_list.iterator();
+    while (it.next()) |node|
+        Hedge.from_node(node).free();
+
+    it = _retransmit_list.iterator();
+    while (it.next()) |node|
+        Retransmit.from_node(node).free();
 }
 
 pub fn check_timeout(timer: *EvLoop.Timer) void {
+    // the preferred upstream didn't reply in time
+    while (!_hedge_list.is_empty()) {
+        const hedge = Hedge.from_node(_hedge_list.head());
+        if (!timer.check_deadline(hedge.deadline))
+            break;
+        nosuspend hedge.fire();
+    }
+
+    // the udp query (or reply) may be lost
+    while (!_retransmit_list.is_empty()) {
+        const retransmit = Retransmit.from_node(_retransmit_list.head());
+        if (!timer.check_deadline(retransmit.deadline))
+            break;
+        nosuspend retransmit.fire();
+    }
+
+    // probe the upstreams that are down
+    var i: usize = 0;
+    while (i < _open_list.items.len) {
+        const upstream = _open_list.items[i];
+        if (upstream.circuit == .closed) {
+            _ = _open_list.swapRemove(i);
+            continue;
+        }
+        if (timer.check_deadline(upstream.probe_time))
+            nosuspend upstream.probe();
+        i += 1;
+    }
+
+    // connect the tcp/tls sessions off the query path
+    for (_warm_list.items) |upstream|
+        nosuspend upstream.keep_warm(timer);
+
+    // replace the expired udp sockets
+    for (_rotate_list.items) |upstream|
+        nosuspend upstream.do_rotate_udp_pool();
+    _rotate_list.clearRetainingCapacity();
+
     var it = _session_list.iterator();
     while (it.next()) |node| {
         const session_node = SessionNode.from(node);
@@ -167,6 +645,124 @@ pub fn check_timeout(timer: *EvLoop.Timer) void {
     }
 }
 
+// ======================================================
+
+/// don't hedge too early (ms)
+const HEDGE_MIN_DELAY = 10;
+
+/// [`--upstream-hedge`] send the query to the backup upstream
+/// if the preferred one doesn't reply within its p95 rtt
+const Hedge = struct {
+    node: Node = undefined, // _hedge_list node
+    deadline: u64,
+    qmsg: *RcMsg, // the same msg sent to the preferred upstream
+    qkey: QueryKey,
+    upstream: *Upstream, // backup upstream
+    udpi: bool,
+
+    fn from_node(node: *Node) *Hedge {
+        return @fieldParentPtr(Hedge, "node", node);
+    }
+
+    fn add(qmsg: *RcMsg, qkey: QueryKey, upstream: *Upstream, udpi: bool, delay: u64) void {
+        const self = g.allocator.create(Hedge) catch unreachable;
+        self.* = .{
+            .deadline = g.evloop.time + delay,
+            .qmsg = qmsg.ref(),
+            .qkey = qkey,
+            .upstream = upstream,
+            .udpi = udpi,
+        };
+
+        _hedge_list.link_by_deadline(Hedge, self);
+    }
+
+    fn free(self: *Hedge) void {
+        self.qmsg.unref();
+        g.allocator.destroy(self);
+    }
+
+    /// [nosuspend] remove from the list, send to the backup upstream if still waiting
+    fn fire(self: *Hedge) void {
+        self.node.unlink();
+        defer self.free();
+
+        if (!server.on_hedge(self.qkey, self.upstream))
+            return;
+
+        stats.hedges += 1;
+        Group.do_send(self.upstream, self.qmsg, self.udpi, self.qkey);
+    }
+};
+
+/// [udp] resend the query if there is no reply within the rto of the upstream. \
+/// the rto is doubled for each retransmission (RFC 6298).
+const Retransmit = struct {
+    node: Node = undefined, // _retransmit_list node
+    deadline: u64,
+    qmsg: *RcMsg,
+    qkey: QueryKey,
+    upstream: *Upstream,
+    udpi: bool,
+    n: u8, // retransmissions so far
+
+    fn from_node(node: *Node) *Retransmit {
+        return @fieldParentPtr(Retransmit, "node", node);
+    }
+
+    fn add(qmsg: *RcMsg, qkey: QueryKey, upstream: *Upstream, udpi: bool, n: u8) void {
+        const self = g.allocator.create(Retransmit) catch unreachable;
+        self.* = .{
+            .deadline = g.evloop.time + (upstream.rto() << @intCast(u6, n)),
+            .qmsg = qmsg.ref(),
+            .qkey = qkey,
+            .upstream = upstream,
+            .udpi = udpi,
+            .n = n,
+        };
+
+        _retransmit_list.link_by_deadline(Retransmit, self);
+    }
+
+    fn free(self: *Retransmit) void {
+        self.qmsg.unref();
+        g.allocator.destroy(self);
+    }
+
+    /// [nosuspend] remove from the list, resend if still waiting
+    fn fire(self: *Retransmit) void {
+        self.node.unlink();
+        defer self.free();
+
+        if (!server.on_retransmit(self.qkey, self.upstream))
+            return;
+
+        self.upstream.on_loss(true);
+
+        // no reply for a while, try another upstream of the group
+        var upstream = self.upstream;
+        if (upstream.is_failing()) {
+            if (groups.get_upstream_group(upstream.tag).alternate(upstream, self.udpi)) |alt|
+                upstream = alt;
+        }
+
+        if (g.verbose())
+            log.info(
+                @src(),
+                "retransmit query(idx:%u) to upstream %s",
+                .{ cc.to_uint(self.qkey.idx), upstream.url },
+            );
+
+        stats.retransmits += 1;
+        nosuspend upstream.send(self.qmsg, self.qkey, true);
+
+        if (upstream.proto.is_udp() and self.n + 1 < RETRANSMIT_MAX)
+            add(self.qmsg, self.qkey, upstream, self.udpi, self.n + 1);
+    }
+};
+
+// ======================================================
+
 const SessionNode = struct {
     type: enum { udp, tcp }, // `struct UDP` or `struct TCP`
     node: Node = undefined, // _session_list node
@@ -199,19 +795,75 @@ const SessionNode = struct {
 
 // ======================================================
 
-/// udp session
+/// recv buffers shared by all udp sessions. \
+/// the batch is received and handled synchronously (nosuspend),
+/// so there is no need for a per-session buffer.
+var _recv_batch: RecvBatch = .{};
+
+const RecvBatch = struct {
+    rmsgs: [N]?*RcMsg = [_]?*RcMsg{null} ** N,
+    iovs: [N]cc.iovec_t = undefined,
+    msgv: [N]cc.mmsghdr_t = undefined,
+
+    /// max number of datagrams per recvmmsg
+    const N = 16;
+
+    /// reset the msghdr, replace the rmsg that are still referenced
+    fn prepare(self: *RecvBatch) []cc.mmsghdr_t {
+        for (self.rmsgs) |*p_rmsg, i| {
+            if (p_rmsg.*) |rmsg| {
+                if (!rmsg.is_unique()) {
+                    rmsg.unref();
+                    p_rmsg.* = null;
+                }
+            }
+
+            const rmsg = p_rmsg.* orelse RcMsg.new(c.DNS_EDNS_MAXSIZE);
+            p_rmsg.* = rmsg;
+
+            self.iovs[i] = .{
+                .iov_base = rmsg.buf().ptr,
+                .iov_len = rmsg.cap,
+            };
+            self.msgv[i] = .{
+                .msg_hdr = .{
+                    .msg_iov = self.iovs[i..].ptr,
+                    .msg_iovlen = 1,
+                },
+            };
+        }
+        return &self.msgv;
+    }
+
+    fn deinit(self: *RecvBatch) void {
+        for (self.rmsgs) |*p_rmsg| {
+            if (p_rmsg.*) |rmsg|
+                rmsg.unref();
+            p_rmsg.* = null;
+        }
+    }
+};
+
+/// udp session (pooled socket)
 const UDP = struct {
     session_node: SessionNode = .{ .type = .udp }, // _session_list node
     upstream: *Upstream,
     fdobj: *EvLoop.Fd,
-    query_list: std.AutoHashMapUnmanaged(u16, void) = .{}, // outstanding queries (qid)
+    qids: QidMap = .{}, // outstanding queries
     create_time: u64,
     query_time: u64 = undefined, // last query time
     query_count: u16 = 0, // total query count
+    pooled: bool = false, // in upstream.udp_pool
     freed: bool = false,
 
+    /// connected socket: only the replies from the upstream are received
     pub fn new(upstream: *Upstream) ?*UDP {
         const fd = net.new_sock(upstream.addr.family(), .udp) orelse return null;
+        cc.connect(fd, &upstream.addr) orelse {
+            log.warn(@src(), "connect(%s) failed: (%d) %m", .{ upstream.url, cc.errno() });
+            _ = cc.close(fd);
+            return null;
+        };
         const self = g.allocator.create(UDP) catch unreachable;
         self.* = .{
             .upstream = upstream,
@@ -231,13 +883,13 @@ const UDP = struct {
         if (!self.is_idle())
             self.session_node.on_idle();
 
-        if (self.upstream.session_eql(self))
-            self.upstream.session = null;
+        if (self.pooled)
+            self.upstream.del_udp_pool(self);
 
         self.fdobj.cancel();
         self.fdobj.free();
 
-        self.query_list.clearAndFree(g.allocator);
+        self.qids.deinit();
 
         g.allocator.destroy(self);
     }
@@ -247,22 +899,17 @@ const UDP = struct {
         return self.query_time + cc.to_u64(g.upstream_timeout) * 1000;
     }
 
-    /// [nosuspend]
-    pub fn send_query(self: *UDP, qmsg: *RcMsg) void {
-        if (self.is_retire()) {
-            const new_session = new(self.upstream);
-            self.upstream.session = new_session;
-
-            if (new_session) |s|
-                nosuspend s.send_query(qmsg);
-
-            if (self.is_idle())
-                self.free();
+    /// [nosuspend] set the msg.id to the qid of this session
+    pub fn send_query(self: *UDP, qmsg: *RcMsg, qkey: QueryKey, retransmit: bool) void {
+        const qid = self.qids.add(qkey).?;
+        dns.set_id(qmsg.msg(), qid);
 
-            return;
-        }
+        // Karn's algorithm: the rtt of the retransmitted copy is ambiguous
+        if (retransmit)
+            self.qids.no_rtt(qid);
 
-        if (self.upstream.tag == .gfw and g.trustdns_packet_n > 1) {
+        const packet_n = self.upstream.packet_n();
+        if (packet_n > 1) {
             var iov = [_]cc.iovec_t{
                 .{
                     .iov_base = qmsg.msg().ptr,
@@ -274,8 +921,6 @@ const UDP = struct {
 
             msgv[0] = .{
                 .msg_hdr = .{
-                    .msg_name = &self.upstream.addr,
-                    .msg_namelen = self.upstream.addr.len(),
                     .msg_iov = &iov,
                     .msg_iovlen = iov.len,
                 },
@@ -283,17 +928,16 @@ const UDP = struct {
 
             // repeat msg
             var i: u8 = 1;
-            while (i < g.trustdns_packet_n) : (i += 1)
+            while (i < packet_n) : (i += 1)
                 msgv[i] = msgv[0];
 
-            _ = cc.sendmmsg(self.fdobj.fd, &msgv, 0) orelse self.on_error("send");
+            _ = cc.sendmmsg(self.fdobj.fd, msgv[0..packet_n], 0) orelse self.on_error("send");
         } else {
-            _ = cc.sendto(self.fdobj.fd, qmsg.msg(), 0, &self.upstream.addr) orelse self.on_error("send");
+            _ = cc.send(self.fdobj.fd, qmsg.msg(), 0) orelse self.on_error("send");
         }
 
-        self.session_node.on_work(self.is_idle());
+        self.session_node.on_work(self.qids.count() == 1);
 
-        self.query_list.put(g.allocator, dns.get_id(qmsg.msg()), {}) catch unreachable;
         self.query_time = g.evloop.time;
         self.query_count +|= 1;
 
@@ -304,23 +948,26 @@ const UDP = struct {
 
     /// no outstanding queries
     fn is_idle(self: *const UDP) bool {
-        return self.query_list.count() == 0;
+        return self.qids.count() == 0;
     }
 
     /// no more queries will be sent. \
     /// freed when the queries completes.
     fn is_retire(self: *const UDP) bool {
-        if (!self.upstream.session_eql(self))
-            return true;
+        return !self.pooled;
+    }
 
-        if ((self.upstream.count > 0 and self.query_count >= self.upstream.count) or
-            (self.upstream.life > 0 and g.evloop.time >= self.create_time + cc.to_u64(self.upstream.life) * 1000))
-        {
-            self.upstream.session = null;
-            return true;
-        }
+    /// reached the `life` limit, to be replaced by a new socket. \
+    /// `count` is not used: the sockets would be created and freed at the rate of the queries.
+    fn is_expired(self: *const UDP) bool {
+        return self.upstream.life > 0 and g.evloop.time >= self.create_time + cc.to_u64(self.upstream.life) * 1000;
+    }
 
-        return false;
+    /// [nosuspend] removed from the pool
+    fn retire(self: *UDP) void {
+        self.pooled = false;
+        if (self.is_idle())
+            self.free();
     }
 
     fn reply_receiver(self: *UDP) void {
@@ -328,34 +975,29 @@ const UDP = struct {
 
         defer self.free();
 
-        var free_rmsg: ?*RcMsg = null;
-        defer if (free_rmsg) |rmsg| rmsg.free();
-
         while (true) {
-            const rmsg = free_rmsg orelse RcMsg.new(c.DNS_EDNS_MAXSIZE);
-            free_rmsg = null;
+            const msgs = g.evloop.read_udp_batch(self.fdobj, _recv_batch.prepare()) orelse {
+                // icmp port unreachable (connected socket), the other queries may still be answered
+                if (!self.fdobj.canceled and cc.errno() == c.ECONNREFUSED) continue;
+                return self.on_error("recv");
+            };
+            stats.upstream_recv_batch.add(msgs.len);
 
-            defer {
-                if (rmsg.is_unique())
-                    free_rmsg = rmsg
-                else
-                    rmsg.unref();
-            }
+            const prev_idle = self.is_idle();
 
-            const len = g.evloop.read_udp(self.fdobj, rmsg.buf(), null) orelse return self.on_error("recv");
-            rmsg.len = cc.to_u16(len);
+            for (msgs) |*m, i| {
+                const rmsg = _recv_batch.rmsgs[i].?;
+                rmsg.len = cc.to_u16(m.msg_len);
 
-            const prev_idle = self.is_idle();
+                // update qids
+                if (rmsg.len < dns.header_len()) continue;
+                const pending = self.qids.remove(dns.get_id(rmsg.msg())) orelse continue;
+                self.upstream.on_answer();
+                self.upstream.on_loss(false);
 
-            // update query_list
-            if (len >= dns.header_len()) {
-                const qid = dns.get_id(rmsg.msg());
-                _ = self.query_list.remove(qid);
+                nosuspend server.on_reply(rmsg, self.upstream, pending.key, pending.rtt);
             }
 
-            // will modify the msg.id
-            nosuspend server.on_reply(rmsg, self.upstream);
-
             // all queries completed
             if (self.is_idle()) {
                 if (!prev_idle)
@@ -377,8 +1019,25 @@ const UDP = struct {
 
 pub const has_tls = build_opts.enable_wolfssl;
 
+const TLSCache_ = if (has_tls) TLS.Cache else struct {};
+
 pub const TLS = struct {
     ssl: ?*c.WOLFSSL = null,
+    early_data: bool = false, // the resumed session allows 0-RTT
+    session_saved: bool = false, // saved to the upstream's cache
+    ktls_tx: bool = false, // the kernel encrypts the written data (`--ktls`)
+
+    /// the last session (ticket) of the upstream, shared by its connections
+    pub const Cache = struct {
+        session: ?*c.WOLFSSL_SESSION = null,
+
+        fn save(self: *Cache, ssl: *c.WOLFSSL) void {
+            const session = cc.SSL_get1_session(ssl) orelse return;
+            if (self.session) |old|
+                cc.SSL_SESSION_free(old);
+            self.session = session;
+        }
+    };
 
     var _ctx: ?*c.WOLFSSL_CTX = null;
 
@@ -406,7 +1065,8 @@ pub const TLS = struct {
         }
     }
 
-    pub fn new_ssl(self: *TLS, fd: c_int, host: ?cc.ConstStr) ?void {
+    /// `alpn`: the application protocol (DoH), null means DoT
+    pub fn new_ssl(self: *TLS, fd: c_int, host: ?cc.ConstStr, cache: *const Cache, alpn: ?[:0]const u8) ?void {
         assert(self.ssl == null);
 
         const ssl = cc.SSL_new(_ctx.?);
@@ -417,14 +1077,46 @@ pub const TLS = struct {
         cc.SSL_set_fd(ssl, fd) orelse return null;
         cc.SSL_set_host(ssl, host, g.cert_verify) orelse return null;
 
+        if (alpn) |protocol|
+            cc.SSL_set_alpn(ssl, protocol) orelse return null;
+
+        // resume the last session, a stale one just falls back to the full handshake
+        if (cache.session) |session| {
+            if (cc.SSL_set_session(ssl, session) != null)
+                self.early_data = cc.SSL_SESSION_allow_early_data(session);
+        }
+
         ok = true;
         self.ssl = ssl;
     }
 
+    /// [after the handshake] hand the tx keys to the kernel, before any SSL_write. \
+    /// wolfssl can't write anymore: a KeyUpdate from the upstream closes the session (reconnect).
+    pub fn enable_ktls(self: *TLS, fd: c_int) void {
+        if (c.ktls_enable_tx(self.ssl.?, fd)) {
+            self.ktls_tx = true;
+            stats.ktls += 1;
+        } else {
+            stats.ktls_failed += 1;
+            if (g.verbose())
+                log.warn(@src(), "failed to enable ktls, fallback to wolfssl: (%d) %m", .{cc.errno()});
+        }
+    }
+
+    /// [recv] the tls13 ticket arrives after the handshake, save the session on the first read
+    pub fn on_read(self: *TLS, cache: *Cache) void {
+        if (self.session_saved) return;
+        self.session_saved = true;
+        cache.save(self.ssl.?);
+    }
+
     // free the ssl obj
     pub fn on_close(self: *TLS) void {
         const ssl = self.ssl orelse return;
         self.ssl = null;
+        self.early_data = false;
+        self.session_saved = false;
+        self.ktls_tx = false;
 
         cc.SSL_free(ssl);
     }
@@ -435,24 +1127,32 @@ const TCP = struct {
     session_node: SessionNode = .{ .type = .tcp }, // _session_list node
     upstream: *Upstream,
     fdobj: ?*EvLoop.Fd = null, // tcp connection
-    tls: TLS_ = .{}, // tls connection (DoT)
+    tls: TLS_ = .{}, // tls connection (DoT/DoH)
+    h2: H2_ = .{}, // http2 connection (DoH)
     send_list: MsgQueue = .{}, // qmsg to be sent
     ack_list: std.AutoHashMapUnmanaged(u16, *RcMsg) = .{}, // qmsg to be ack
+    qids: QidMap = .{}, // outstanding queries: send_list + ack_list
     create_time: u64, // last connect time
     query_time: u64 = undefined, // last query time
     query_count: u16 = 0, // total query count
-    pending_n: u16 = 0, // outstanding queries: send_list + ack_list
+    reply_time: u64 = 0, // last reply time
+    keepalive: ?u16 = null, // idle timeout (100ms) advertised by the upstream (edns-tcp-keepalive)
+    pooled: bool = false, // in upstream.tcp_pool
     flags: packed struct {
         freed: bool = false, // free()
         starting: bool = false, // start()
         stopping: bool = false, // stop()
         in_sender: bool = false, // query_sender()
+        syn_data: bool = false, // the first write is carried by the SYN (tcp fastopen)
+        warming: bool = false, // connecting, to take over the slot of a retiring session (upstream.tcp_next)
+        connected: bool = false, // the handshake is done, the queries are written without waiting for it
     } = .{},
 
     const TLS_ = if (has_tls) TLS else struct {};
+    const H2_ = if (has_tls) H2 else struct {};
 
-    /// must <= u16_max
-    const PENDING_MAX = std.math.maxInt(u16);
+    /// queries written at once (one writev, or one tls record of max 16KB)
+    const SEND_BATCH_MAX = 16384 / (2 + c.DNS_QMSG_MAXSIZE);
 
     const MsgQueue = struct {
         head: ?*Msg = null,
@@ -562,8 +1262,8 @@ const TCP = struct {
         if (!self.is_idle())
             self.session_node.on_idle();
 
-        if (self.upstream.session_eql(self))
-            self.upstream.session = null;
+        self.upstream.del_tcp_pool(self);
+        self.upstream.del_tcp_next(self);
 
         self.send_list.cancel_wait();
 
@@ -573,12 +1273,15 @@ const TCP = struct {
             self.fdobj = null;
         }
 
-        if (has_tls)
+        if (has_tls) {
             self.tls.on_close();
+            self.h2.deinit();
+        }
 
         self.send_list.clear();
         self.clear_ack_list(.unref);
         self.ack_list.clearAndFree(g.allocator);
+        self.qids.deinit();
 
         g.allocator.destroy(self);
     }
@@ -590,48 +1293,88 @@ const TCP = struct {
 
     /// no outstanding queries
     fn is_idle(self: *const TCP) bool {
-        return self.pending_n == 0;
+        return self.qids.count() == 0;
     }
 
     /// no more queries will be sent. \
     /// freed when the queries completes.
-    fn is_retire(self: *const TCP) bool {
-        if (!self.upstream.session_eql(self))
-            return true;
+    fn is_retire(self: *TCP) bool {
+        if (!self.pooled)
+            return !self.flags.warming;
+
+        const retire_time = self.retire_time();
 
-        if ((self.upstream.count > 0 and self.query_count >= self.upstream.count) or
-            (self.upstream.life > 0 and g.evloop.time >= self.create_time + cc.to_u64(self.upstream.life) * 1000))
+        if (self.is_count_limited(1, 1) or
+            (retire_time != null and g.evloop.time >= retire_time.?) or
+            (has_tls and self.h2.goaway))
         {
-            self.upstream.session = null;
+            self.upstream.del_tcp_pool(self);
             return true;
         }
 
         return false;
     }
 
-    /// add to send queue, `qmsg.ref++`
-    pub fn send_query(self: *TCP, qmsg: *RcMsg) void {
-        if (self.is_retire()) {
-            const new_session = new(self.upstream);
-            self.upstream.session = new_session;
-
-            nosuspend new_session.send_query(qmsg);
+    /// [`--upstream-warm`] the `count` (3/4) or `life` (or idle timeout) limit will be reached soon
+    fn is_retiring(self: *const TCP) bool {
+        const retire_time = self.retire_time();
+        return self.is_count_limited(3, 4) or
+            (retire_time != null and g.evloop.time + WARM_LEAD >= retire_time.?) or
+            (has_tls and self.h2.goaway);
+    }
 
-            if (self.is_idle())
-                self.free();
+    /// the `count` limit (`num/den` of it) is reached. \
+    /// not used if the upstream manages the session with its idle timeout.
+    fn is_count_limited(self: *const TCP, comptime num: u32, comptime den: u32) bool {
+        const count = self.upstream.count;
+        if (count == 0 or self.keepalive != null)
+            return false;
+        return @as(u32, self.query_count) * den >= @as(u32, count) * num;
+    }
 
-            return;
+    /// the `life` limit, or the idle timeout advertised by the upstream (edns-tcp-keepalive). \
+    /// the latter applies to the idle session only, a timeout of 0 means "close it soon".
+    fn retire_time(self: *const TCP) ?u64 {
+        if (self.keepalive) |timeout| {
+            if (!self.is_idle()) return null;
+            return (self.reply_time + cc.to_u64(timeout) * 100) -| KEEPALIVE_MARGIN;
         }
+        if (self.upstream.life > 0)
+            return self.create_time + cc.to_u64(self.upstream.life) * 1000;
+        return null;
+    }
 
-        if (self.pending_n >= PENDING_MAX) {
-            log.warn(@src(), "too many pending queries: %u", .{cc.to_uint(self.pending_n)});
-            return;
-        }
+    /// [`--edns-keepalive`] tcp/DoT only, the option is not used in DoH (RFC 8484)
+    fn use_keepalive(self: *const TCP) bool {
+        return g.flags.edns_keepalive and self.upstream.proto != .https;
+    }
+
+    /// add a copy of `qmsg` to send queue (msg.id is the qid of this session)
+    pub fn send_query(self: *TCP, qmsg: *RcMsg, qkey: QueryKey, retransmit: bool) void {
+        assert(self.pooled and !self.qids.is_full());
 
         self.session_node.on_work(self.is_idle());
 
-        self.pending_n += 1;
-        self.send_list.push(qmsg.ref());
+        // the qmsg is shared by the upstreams of the group
+        const keepalive = self.use_keepalive();
+        const cap = if (keepalive) std.math.min(qmsg.len + 15, c.DNS_QMSG_MAXSIZE) else qmsg.len; // OPT RR + option
+        const msg = RcMsg.new(cc.to_u16(cap));
+        msg.len = qmsg.len;
+        @memcpy(msg.msg().ptr, qmsg.msg().ptr, qmsg.len);
+        const qid = self.qids.add(qkey).?;
+        dns.set_id(msg.msg(), qid);
+
+        // the reply is delayed by the connect (and the tls handshake)
+        if (retransmit or !self.flags.connected)
+            self.qids.no_rtt(qid);
+
+        // ask the upstream for its idle timeout (sent as is if no room)
+        if (keepalive) {
+            const len = dns.add_tcp_keepalive(msg.buf(), msg.len);
+            if (len > 0) msg.len = len;
+        }
+
+        self.send_list.push(msg);
 
         self.query_time = g.evloop.time;
         self.query_count +|= 1;
@@ -641,35 +1384,54 @@ const TCP = struct {
             self.start();
     }
 
-    /// [suspending] pop from send_list && add to ack_list
-    fn pop_qmsg(self: *TCP) ?*RcMsg {
-        const qmsg = self.send_list.pop(true) orelse return null;
-        self.on_send_msg(qmsg);
-        return qmsg;
+    /// [suspending] pop all (at most `batch.len`) from send_list && add to ack_list
+    fn pop_qmsgs(self: *TCP, batch: []*RcMsg) ?[]*RcMsg {
+        batch[0] = self.send_list.pop(true) orelse return null;
+
+        // the queries added during the previous write (or the connect)
+        var n: usize = 1;
+        while (n < batch.len) : (n += 1)
+            batch[n] = self.send_list.pop(false) orelse break;
+
+        for (batch[0..n]) |qmsg|
+            self.on_send_msg(qmsg);
+
+        return batch[0..n];
     }
 
-    /// add qmsg to ack_list
+    /// add qmsg to ack_list (the qid is unique in this session)
     fn on_send_msg(self: *TCP, qmsg: *RcMsg) void {
         const qid = dns.get_id(qmsg.msg());
-        if (self.ack_list.fetchPut(g.allocator, qid, qmsg) catch unreachable) |old| {
-            old.value.unref();
-            self.pending_n -= 1;
-            assert(self.pending_n > 0);
-            log.warn(@src(), "duplicated qid:%u to %s", .{ cc.to_uint(qid), self.upstream.url });
-        }
+        self.ack_list.putNoClobber(g.allocator, qid, qmsg) catch unreachable;
     }
 
-    /// remove qmsg from ack_list && qmsg.unref()
-    fn on_recv_msg(self: *TCP, rmsg: *const RcMsg) void {
+    /// remove qmsg from ack_list && qmsg.unref(), return the pending query
+    fn on_recv_msg(self: *TCP, rmsg: *const RcMsg) ?QidMap.Pending {
         const qid = dns.get_id(rmsg.msg());
         if (self.ack_list.fetchRemove(qid)) |kv| {
-            self.pending_n -= 1;
             kv.value.unref();
+            self.upstream.on_answer();
+            return self.qids.remove(qid).?;
         } else {
             log.warn(@src(), "unexpected msg_id:%u from %s", .{ cc.to_uint(qid), self.upstream.url });
+            return null;
         }
     }
 
+    /// [`--edns-keepalive`] the idle timeout of the session is managed by the upstream (RFC 7828)
+    fn on_keepalive(self: *TCP, rmsg: []const u8) void {
+        const timeout = dns.get_tcp_keepalive(rmsg) orelse return;
+
+        if (self.keepalive == null)
+            stats.keepalive += 1;
+
+        const changed = if (self.keepalive) |old| old != timeout else true;
+        if (g.verbose() and changed)
+            log.info(@src(), "%s idle timeout: %u ms", .{ self.upstream.url, cc.to_uint(timeout) * 100 });
+
+        self.keepalive = timeout;
+    }
+
     fn stop(self: *TCP) void {
         if (self.flags.in_sender) {
             self.flags.stopping = true;
@@ -685,6 +1447,7 @@ const TCP = struct {
             defer self.flags.stopping = false;
 
             self.send_list.cancel_wait();
+            self.flags.connected = false;
 
             if (self.fdobj) |fdobj| {
                 fdobj.cancel();
@@ -696,20 +1459,26 @@ const TCP = struct {
                 self.tls.on_close();
         }
 
-        if (self.pending_n > 0) {
+        if (!self.is_idle()) {
             if (!self.flags.starting) {
                 // restart
                 self.clear_ack_list(.resend);
+                self.qids.no_rtt_all();
                 self.start(); // must be at the end
             } else {
                 // local error
                 self.clear_ack_list(.unref);
                 self.send_list.clear();
-                self.pending_n = 0;
+                self.qids.clear();
                 self.session_node.on_idle();
             }
         } else {
             // idle
+            if (self.flags.warming) {
+                // failed to connect, retried by keep_warm
+                self.flags.warming = false;
+                self.upstream.del_tcp_next(self);
+            }
             if (!self.flags.starting and self.is_retire())
                 self.free();
         }
@@ -727,14 +1496,15 @@ const TCP = struct {
         self.ack_list.clearRetainingCapacity();
     }
 
-    /// may call `self.free()`
+    /// may call `self.free()` \
+    /// idle: connect only (`--upstream-warm`), the queries are sent when added
     fn start(self: *TCP) void {
         assert(self.fdobj == null);
-        assert(self.pending_n > 0);
-        assert(!self.send_list.is_empty());
+        assert(self.is_idle() == self.send_list.is_empty());
         assert(self.ack_list.count() == 0);
 
         self.create_time = g.evloop.time;
+        self.keepalive = null; // advertised again in the new connection
 
         self.flags.starting = true;
         co.start(query_sender, .{self});
@@ -751,6 +1521,7 @@ const TCP = struct {
 
         const fd = net.new_tcp_conn_sock(self.upstream.addr.family()) orelse return;
         self.fdobj = EvLoop.Fd.new(fd);
+        stats.tcp_connects += 1;
 
         self.connect() orelse return;
 
@@ -763,8 +1534,17 @@ const TCP = struct {
             return; // do stop()
         }
 
-        while (self.pop_qmsg()) |qmsg|
-            self.send(qmsg) orelse return;
+        self.flags.connected = true;
+
+        // connected, the queries of the retiring session are no longer blocked by the handshake
+        if (self.flags.warming)
+            self.upstream.on_warm(self);
+
+        var batch: [SEND_BATCH_MAX]*RcMsg = undefined;
+        while (self.pop_qmsgs(&batch)) |qmsgs| {
+            stats.upstream_tcp_send_msgs.add(qmsgs.len);
+            self.send(qmsgs) orelse return;
+        }
     }
 
     fn reply_receiver(self: *TCP) void {
@@ -775,51 +1555,123 @@ const TCP = struct {
         var free_rmsg: ?*RcMsg = null;
         defer if (free_rmsg) |rmsg| rmsg.free();
 
+        // all the available replies are received with a single read
+        var rbuf: RecvBuf = .{};
+        defer rbuf.deinit();
+
         while (true) {
-            // read the len
-            var len: u16 = undefined;
-            self.recv(std.mem.asBytes(&len)) orelse return;
-
-            // check the len
-            len = cc.ntohs(len);
-            if (len < dns.header_len()) {
-                log.warn(@src(), "recv(%s) failed: invalid len:%u", .{ self.upstream.url, cc.to_uint(len) });
-                return;
-            }
+            var msg_n: usize = 0;
 
-            const rmsg: *RcMsg = if (free_rmsg) |rmsg| rmsg.realloc(len) else RcMsg.new(len);
-            free_rmsg = null;
+            while (self.next_msg(&rbuf) orelse return) |msg| : (msg_n += 1) {
+                // check the len
+                if (msg.len < dns.header_len()) {
+                    log.warn(@src(), "recv(%s) failed: invalid len:%zu", .{ self.upstream.url, msg.len });
+                    return;
+                }
 
-            defer {
-                if (rmsg.is_unique())
-                    free_rmsg = rmsg
-                else
-                    rmsg.unref();
-            }
+                const len = cc.to_u16(msg.len);
+                const rmsg: *RcMsg = if (free_rmsg) |rmsg| rmsg.realloc(len) else RcMsg.new(len);
+                free_rmsg = null;
 
-            // read the msg
-            rmsg.len = len;
-            self.recv(rmsg.msg()) orelse return;
+                defer {
+                    if (rmsg.is_unique())
+                        free_rmsg = rmsg
+                    else
+                        rmsg.unref();
+                }
 
-            const prev_idle = self.is_idle();
+                rmsg.len = len;
+                @memcpy(rmsg.msg().ptr, msg.ptr, msg.len);
 
-            // update ack_list
-            self.on_recv_msg(rmsg);
+                const prev_idle = self.is_idle();
 
-            // will modify the msg.id
-            nosuspend server.on_reply(rmsg, self.upstream);
+                self.reply_time = g.evloop.time;
+                if (self.use_keepalive())
+                    self.on_keepalive(rmsg.msg());
 
-            // all queries completed
-            if (self.is_idle()) {
-                if (!prev_idle)
-                    self.session_node.on_idle();
+                // update ack_list
+                if (self.on_recv_msg(rmsg)) |pending|
+                    nosuspend server.on_reply(rmsg, self.upstream, pending.key, pending.rtt);
 
-                if (self.is_retire())
+                // all queries completed
+                if (self.is_idle()) {
+                    if (!prev_idle)
+                        self.session_node.on_idle();
+
+                    if (self.is_retire())
+                        return; // stop and free
+                }
+            }
+
+            if (msg_n > 0)
+                stats.upstream_tcp_read_msgs.add(msg_n);
+
+            if (has_tls and self.upstream.proto == .https) {
+                // GOAWAY: no more new streams
+                if (self.is_idle() and self.is_retire())
                     return; // stop and free
+
+                // SETTINGS/PING ack, WINDOW_UPDATE
+                self.h2_flush() orelse return;
+            }
+
+            const space = if (has_tls and self.upstream.proto == .https)
+                rbuf.space_n(H2.RECV_BUF_SIZE)
+            else
+                rbuf.space();
+
+            const n = self.recv(space) orelse return;
+            rbuf.commit(n);
+
+            if (self.flags.syn_data) {
+                self.flags.syn_data = false;
+                if (c.is_tcp_syn_data_acked(self.fdobj.?.fd))
+                    stats.tfo_ok += 1
+                else // the upstream dropped the data in the SYN, sent again after the handshake
+                    stats.tfo_rejected += 1;
             }
         }
     }
 
+    /// the next reply in the received data, null if incomplete \
+    /// the outer null means a protocol error (DoH)
+    fn next_msg(self: *TCP, rbuf: *RecvBuf) ??[]const u8 {
+        if (!(has_tls and self.upstream.proto == .https)) {
+            const msg: ?[]const u8 = rbuf.next();
+            return msg;
+        }
+
+        while (true) {
+            const res = self.h2.next(rbuf) catch {
+                log.warn(@src(), "recv(%s) failed: invalid http2 frame", .{self.upstream.url});
+                return null;
+            } orelse return @as(?[]const u8, null);
+
+            switch (res) {
+                .msg => |msg| return msg,
+                .failed => |qid| if (self.h2_failed(qid)) |msg| return msg,
+            }
+        }
+    }
+
+    /// [DoH] RST_STREAM or non-200 response: SERVFAIL in place of the reply (may fall back) \
+    /// return the msg (global static buffer), null if the query is unknown
+    fn h2_failed(self: *TCP, qid: u16) ?[]const u8 {
+        const qmsg = self.ack_list.get(qid) orelse return null;
+
+        if (g.verbose())
+            log.info(@src(), "%s stream failed: msg_id:%u", .{ self.upstream.url, cc.to_uint(qid) });
+
+        const msg = cc.static_buf(qmsg.len); // global static buffer
+        @memcpy(msg.ptr, qmsg.msg().ptr, qmsg.len);
+
+        var qnamelen: c_int = undefined;
+        if (!dns.check_query(msg, null, &qnamelen))
+            return null;
+
+        return dns.error_reply(msg, qnamelen, c.DNS_RCODE_SERVFAIL);
+    }
+
     /// `errmsg`: null means strerror(errno)
     fn on_error(self: *const TCP, op: cc.ConstStr, errmsg: ?cc.ConstStr) ?void {
         const src = @src();
@@ -843,10 +1695,47 @@ const TCP = struct {
         // null means strerror(errno)
         const errmsg: ?cc.ConstStr = e: {
             const fdobj = self.fdobj.?;
-            g.evloop.connect(fdobj, &self.upstream.addr) orelse break :e null;
-
-            if (has_tls and self.upstream.proto == .tls) {
-                self.tls.new_ssl(fdobj.fd, self.upstream.host) orelse break :e "unable to create ssl object";
+            const deferred = g.evloop.connect(fdobj, &self.upstream.addr) orelse break :e null;
+
+            // `--tcp-fastopen`: no cookie for the upstream yet, it's just a normal connect
+            self.flags.syn_data = g.flags.tcp_fastopen and deferred;
+            if (g.flags.tcp_fastopen and !deferred)
+                stats.tfo_fallback += 1;
+
+            if (has_tls and self.upstream.proto.is_tls()) {
+                const alpn: ?[:0]const u8 = if (self.upstream.proto == .https) "h2" else null;
+                self.tls.new_ssl(fdobj.fd, self.upstream.host, &self.upstream.tls_cache, alpn) orelse break :e "unable to create ssl object";
+
+                const start_time = g.evloop.time;
+
+                // tls13 0-RTT: the first query is sent along with the ClientHello (DoT only)
+                const early_msg = if (self.tls.early_data and self.upstream.proto == .tls) self.send_list.pop(false) else null;
+                if (early_msg) |qmsg| {
+                    self.on_send_msg(qmsg);
+
+                    var buf: [2 + c.DNS_QMSG_MAXSIZE]u8 = undefined;
+                    const data = tls_frame(&buf, &.{qmsg});
+
+                    while (true) {
+                        var err: c_int = undefined;
+                        cc.SSL_write_early_data(self.ssl(), data, &err) orelse switch (err) {
+                            c.WOLFSSL_ERROR_WANT_READ => {
+                                g.evloop.wait_readable(fdobj) orelse return null;
+                                continue;
+                            },
+                            c.WOLFSSL_ERROR_WANT_WRITE => {
+                                g.evloop.wait_writable(fdobj) orelse return null;
+                                continue;
+                            },
+                            else => {
+                                break :e cc.SSL_error_string(err);
+                            },
+                        };
+                        break;
+                    }
+
+                    stats.tls_early_data += 1;
+                }
 
                 while (true) {
                     var err: c_int = undefined;
@@ -866,11 +1755,39 @@ const TCP = struct {
                     break;
                 }
 
+                const resumed = cc.SSL_session_reused(self.ssl());
+                const elapsed = g.evloop.time - start_time;
+                if (resumed) {
+                    stats.tls_resumed += 1;
+                    stats.tls_resumed_ms += elapsed;
+                } else {
+                    stats.tls_full += 1;
+                    stats.tls_full_ms += elapsed;
+                }
+
+                if (g.flags.ktls)
+                    self.tls.enable_ktls(fdobj.fd);
+
+                // connection preface
+                if (self.upstream.proto == .https) {
+                    self.h2.start(cc.strslice_c(self.upstream.host.?), cc.strslice_c(self.upstream.path.?));
+                    self.h2_flush() orelse return null;
+                }
+
+                if (early_msg) |qmsg| {
+                    if (cc.SSL_early_data_accepted(self.ssl()))
+                        stats.tls_early_data_accepted += 1
+                    else // rejected, send it again as normal data
+                        self.send(&.{qmsg}) orelse return null;
+                }
+
                 if (g.verbose())
-                    log.info(@src(), "%s | %s | %s", .{
+                    log.info(@src(), "%s | %s | %s | %s%s", .{
                         self.upstream.url,
                         cc.SSL_get_version(self.ssl()),
                         cc.SSL_get_cipher(self.ssl()),
+                        cc.b2s(resumed, "resumed", "full handshake"),
+                        cc.b2s(self.tls.ktls_tx, " | ktls", ""),
                     });
             }
 
@@ -880,43 +1797,43 @@ const TCP = struct {
         return self.on_error("connect", errmsg);
     }
 
-    fn send(self: *TCP, qmsg: *RcMsg) ?void {
+    /// write the queries at once
+    fn send(self: *TCP, qmsgs: []const *RcMsg) ?void {
+        if (has_tls and self.upstream.proto == .https) {
+            for (qmsgs) |qmsg|
+                self.h2.add_query(qmsg.msg());
+            return self.h2_flush();
+        }
+
         // null means strerror(errno)
         const errmsg: ?cc.ConstStr = e: {
             const fdobj = self.fdobj.?;
 
-            if (self.upstream.proto != .tls) {
-                var iovec = [_]cc.iovec_t{
-                    .{
-                        .iov_base = std.mem.asBytes(&cc.htons(qmsg.len)),
+            // ktls: the same as tcp, the kernel makes the tls record
+            if (self.upstream.proto != .tls or (has_tls and self.tls.ktls_tx)) {
+                var lens: [SEND_BATCH_MAX]u16 = undefined;
+                var iovec: [SEND_BATCH_MAX * 2]cc.iovec_t = undefined;
+                for (qmsgs) |qmsg, i| {
+                    lens[i] = cc.htons(qmsg.len);
+                    iovec[i * 2] = .{
+                        .iov_base = std.mem.asBytes(&lens[i]),
                         .iov_len = @sizeOf(u16),
-                    },
-                    .{
+                    };
+                    iovec[i * 2 + 1] = .{
                         .iov_base = qmsg.msg().ptr,
                         .iov_len = qmsg.len,
-                    },
-                };
-                g.evloop.writev(fdobj, &iovec) orelse break :e null;
-            } else if (has_tls) {
-                // merge into one ssl record
-                var buf: [2 + c.DNS_QMSG_MAXSIZE]u8 align(2) = undefined;
-                const data = buf[0 .. 2 + qmsg.len];
-                std.mem.bytesAsValue(u16, data[0..2]).* = cc.htons(qmsg.len);
-                @memcpy(data[2..].ptr, qmsg.msg().ptr, qmsg.len);
-
-                while (true) {
-                    var err: c_int = undefined;
-                    cc.SSL_write(self.ssl(), data, &err) orelse switch (err) {
-                        c.WOLFSSL_ERROR_WANT_WRITE => {
-                            g.evloop.wait_writable(fdobj) orelse return null;
-                            continue;
-                        },
-                        else => {
-                            break :e cc.SSL_error_string(err);
-                        },
                     };
-                    break;
                 }
+                g.evloop.writev(fdobj, iovec[0 .. qmsgs.len * 2]) orelse break :e null;
+            } else if (has_tls) {
+                if (qmsgs.len == 1) {
+                    var buf: [2 + c.DNS_QMSG_MAXSIZE]u8 = undefined;
+                    return self.write_tls(tls_frame(&buf, qmsgs));
+                }
+                // on the heap, a 16KB local would enlarge the coroutine frame of every session
+                const buf = g.allocator.alloc(u8, SEND_BATCH_MAX * (2 + c.DNS_QMSG_MAXSIZE)) catch unreachable;
+                defer g.allocator.free(buf);
+                return self.write_tls(tls_frame(buf, qmsgs));
             } else unreachable;
 
             return;
@@ -925,22 +1842,76 @@ const TCP = struct {
         return self.on_error("send", errmsg);
     }
 
-    /// read the `buf` full
-    fn recv(self: *TCP, buf: []u8) ?void {
+    /// write the http2 frames (DoH), there is only one writer at a time. \
+    /// the frames added during the writing are written by the current writer.
+    fn h2_flush(self: *TCP) ?void {
+        if (self.h2.writing)
+            return;
+
+        self.h2.writing = true;
+        defer self.h2.writing = false;
+
+        while (self.h2.take_out()) |data|
+            self.write_tls(data) orelse return null;
+    }
+
+    /// write all the data to the tls connection
+    fn write_tls(self: *TCP, data: []const u8) ?void {
         // null means strerror(errno)
         const errmsg: ?cc.ConstStr = e: {
             const fdobj = self.fdobj.?;
 
-            if (self.upstream.proto != .tls) {
-                g.evloop.read(fdobj, buf) catch |err| switch (err) {
+            if (self.tls.ktls_tx) {
+                g.evloop.write(fdobj, data) orelse break :e null;
+                return;
+            }
+
+            while (true) {
+                var err: c_int = undefined;
+                cc.SSL_write(self.ssl(), data, &err) orelse switch (err) {
+                    c.WOLFSSL_ERROR_WANT_WRITE => {
+                        g.evloop.wait_writable(fdobj) orelse return null;
+                        continue;
+                    },
+                    else => {
+                        break :e cc.SSL_error_string(err);
+                    },
+                };
+                break;
+            }
+
+            return;
+        };
+
+        return self.on_error("send", errmsg);
+    }
+
+    /// length-prefixed msgs, merged into one ssl record
+    fn tls_frame(buf: []u8, qmsgs: []const *RcMsg) []const u8 {
+        var len: usize = 0;
+        for (qmsgs) |qmsg| {
+            std.mem.writeIntBig(u16, buf[len..][0..2], qmsg.len);
+            @memcpy(buf[len + 2 ..].ptr, qmsg.msg().ptr, qmsg.len);
+            len += 2 + qmsg.len;
+        }
+        return buf[0..len];
+    }
+
+    /// read at least one byte, return the number of bytes read
+    fn recv(self: *TCP, buf: []u8) ?usize {
+        // null means strerror(errno)
+        const errmsg: ?cc.ConstStr = e: {
+            const fdobj = self.fdobj.?;
+
+            if (!self.upstream.proto.is_tls()) {
+                return g.evloop.read_some(fdobj, buf) catch |err| switch (err) {
                     error.eof => return null,
                     error.errno => break :e null,
                 };
             } else if (has_tls) {
-                var nread: usize = 0;
-                while (nread < buf.len) {
+                while (true) {
                     var err: c_int = undefined;
-                    const n = cc.SSL_read(self.ssl(), buf[nread..], &err) orelse switch (err) {
+                    const n = cc.SSL_read(self.ssl(), buf, &err) orelse switch (err) {
                         c.WOLFSSL_ERROR_ZERO_RETURN => { // TLS EOF
                             return null;
                         },
@@ -952,14 +1923,14 @@ const TCP = struct {
                             break :e cc.SSL_error_string(err);
                         },
                     };
-                    nread += n;
+                    self.tls.on_read(&self.upstream.tls_cache);
+                    return n;
                 }
             } else unreachable;
-
-            return;
         };
 
-        return self.on_error("recv", errmsg);
+        _ = self.on_error("recv", errmsg);
+        return null;
     }
 };
 
@@ -973,6 +1944,7 @@ pub const Proto = enum {
     udp, // "udp://1.1.1.1"
     tcp, // "tcp://1.1.1.1"
     tls, // "tls://1.1.1.1"
+    https, // "https://1.1.1.1/dns-query"
 
     /// "tcp://"
     pub fn from_str(str: []const u8) ?Proto {
@@ -980,6 +1952,7 @@ pub const Proto = enum {
             .{ .str = "udp://", .proto = .udp },
             .{ .str = "tcp://", .proto = .tcp },
             .{ .str = "tls://", .proto = .tls },
+            .{ .str = "https://", .proto = .https },
         } else .{
             .{ .str = "udp://", .proto = .udp },
             .{ .str = "tcp://", .proto = .tcp },
@@ -999,17 +1972,28 @@ pub const Proto = enum {
             .udp => "udp://",
             .tcp => "tcp://",
             .tls => "tls://",
+            .https => "https://",
             else => unreachable,
         };
     }
 
     pub fn require_host(self: Proto) bool {
-        return self == .tls;
+        return self.is_tls();
+    }
+
+    pub fn is_udp(self: Proto) bool {
+        return self == .udp or self == .udpi;
+    }
+
+    /// over tls: DoT, DoH
+    pub fn is_tls(self: Proto) bool {
+        return self == .tls or self == .https;
     }
 
     pub fn std_port(self: Proto) u16 {
         return switch (self) {
             .tls => 853,
+            .https => 443,
             else => 53,
         };
     }
@@ -1023,6 +2007,10 @@ pub const Proto = enum {
 
 pub const Group = struct {
     list: std.ArrayListUnmanaged(Upstream) = .{},
+    query_n: u8 = 0, // for the periodic fan-out (`--upstream-best`)
+
+    /// send to all the upstreams every N queries, to refresh the estimates
+    const EXPLORE_INTERVAL = 64;
 
     pub inline fn items(self: *const Group) []Upstream {
         return self.list.items;
@@ -1039,7 +2027,7 @@ pub const Group = struct {
         return null;
     }
 
-    /// "[proto://][host@]ip[#port][?count=N][?life=N]"
+    /// "[proto://][host@]ip[#port][/path][?count=N][?life=N][?conns=N]"
     pub fn add(self: *Group, tag: Tag, url: []const u8) ?void {
         @setCold(true);
 
@@ -1056,7 +2044,7 @@ pub const Group = struct {
             break :b Proto.raw;
         };
 
-        // host, only DoT needs it
+        // host, only DoT/DoH needs it
         const host = b: {
             if (std.mem.indexOf(u8, rest, "@")) |i| {
                 const host = rest[0..i];
@@ -1072,6 +2060,7 @@ pub const Group = struct {
 
         var count = DEFAULT_COUNT;
         var life = DEFAULT_LIFE;
+        var conns = DEFAULT_CONNS;
 
         // ?param=value
         while (std.mem.lastIndexOfScalar(u8, rest, '?')) |i| {
@@ -1087,11 +2076,29 @@ pub const Group = struct {
                 count = value_int;
             } else if (std.mem.eql(u8, name, "life")) {
                 life = value_int;
+            } else if (std.mem.eql(u8, name, "conns")) {
+                if (value_int < 1 or value_int > TCP_POOL_MAX)
+                    return parse_failed("invalid param value", name_value);
+                conns = value_int;
             } else {
                 return parse_failed("unknown param name", name_value);
             }
         }
 
+        // path, only for DoH (the host is the :authority)
+        const path = b: {
+            if (proto != .https)
+                break :b "";
+            if (host.len == 0)
+                return parse_failed("host required", url);
+            if (std.mem.indexOfScalar(u8, rest, '/')) |i| {
+                const path = rest[i..];
+                rest = rest[0..i];
+                break :b path;
+            }
+            break :b DEFAULT_PATH;
+        };
+
         // port
         const port = b: {
             if (std.mem.lastIndexOfScalar(u8, rest, '#')) |i| {
@@ -1108,10 +2115,10 @@ pub const Group = struct {
 
         if (proto == .raw) {
             // `bind_tcp/bind_udp` conditions can't be checked because `opt.parse()` is being executed
-            self.do_add(tag, .udpi, host, ip, port, count, life);
-            self.do_add(tag, .tcpi, host, ip, port, count, life);
+            self.do_add(tag, .udpi, host, path, ip, port, count, life, conns);
+            self.do_add(tag, .tcpi, host, path, ip, port, count, life, conns);
         } else {
-            self.do_add(tag, proto, host, ip, port, count, life);
+            self.do_add(tag, proto, host, path, ip, port, count, life, conns);
         }
     }
 
@@ -1120,23 +2127,26 @@ pub const Group = struct {
         tag: Tag,
         proto: Proto,
         host: []const u8,
+        path: []const u8,
         ip: []const u8,
         port: u16,
         count: ParamValue,
         life: ParamValue,
+        conns: ParamValue,
     ) void {
         const addr = cc.SockAddr.from_text(cc.to_cstr(ip), port);
 
         for (self.items()) |*upstream| {
-            if (upstream.eql(proto, &addr, host)) {
+            if (upstream.eql(proto, &addr, host, path)) {
                 upstream.count = count;
                 upstream.life = life;
+                upstream.conns = conns;
                 return;
             }
         }
 
         const ptr = self.list.addOne(g.allocator) catch unreachable;
-        ptr.* = Upstream.init(tag, proto, &addr, host, ip, port, count, life);
+        ptr.* = Upstream.init(tag, proto, &addr, host, path, ip, port, count, life, conns);
     }
 
     pub fn rm_useless(self: *Group) void {
@@ -1168,26 +2178,106 @@ pub const Group = struct {
     // ======================================================
 
     /// [nosuspend]
-    pub fn send(self: *Group, qmsg: *RcMsg, udpi: bool) void {
-        const verbose_info = if (g.verbose()) .{
-            .qid = dns.get_id(qmsg.msg()),
-            .from = cc.b2s(udpi, "udp", "tcp"),
-        } else undefined;
+    pub fn send(self: *Group, qmsg: *RcMsg, udpi: bool, qkey: QueryKey) void {
+        if (g.flags.upstream_best or g.flags.upstream_hedge) {
+            if (self.pick(udpi)) |picked| {
+                const best = picked.best;
+                do_send(best, qmsg, udpi, qkey);
+
+                if (picked.second) |second| {
+                    if (g.flags.upstream_hedge)
+                        Hedge.add(qmsg, qkey, second, udpi, best.hedge_delay())
+                    else if (second.srtt < best.srtt * 2)
+                        do_send(second, qmsg, udpi, qkey); // not much slower, send as a backup
+                }
+                return;
+            }
+        }
 
-        const in_proto: Proto = if (udpi) .udpi else .tcpi;
+        var sent = false;
+        for (self.items()) |*upstream| {
+            if (upstream.accept_from(udpi) and upstream.circuit == .closed) {
+                do_send(upstream, qmsg, udpi, qkey);
+                sent = true;
+            }
+        }
+
+        // all the circuits are open, keep trying
+        if (!sent) {
+            for (self.items()) |*upstream| {
+                if (upstream.accept_from(udpi))
+                    do_send(upstream, qmsg, udpi, qkey);
+            }
+        }
+    }
 
+    /// all the upstreams are out of rotation (circuit open)
+    pub fn is_down(self: *const Group) bool {
         for (self.items()) |*upstream| {
-            if (upstream.proto == .udpi or upstream.proto == .tcpi)
-                if (upstream.proto != in_proto) continue;
+            if (upstream.circuit == .closed)
+                return false;
+        }
+        return !self.is_empty();
+    }
 
-            if (g.verbose())
-                log.info(
-                    @src(),
-                    "forward query(qid:%u, from:%s) to upstream %s",
-                    .{ cc.to_uint(verbose_info.qid), verbose_info.from, upstream.url },
-                );
+    /// [nosuspend]
+    fn do_send(upstream: *Upstream, qmsg: *RcMsg, udpi: bool, qkey: QueryKey) void {
+        if (g.verbose())
+            log.info(
+                @src(),
+                "forward query(idx:%u, from:%s) to upstream %s",
+                .{ cc.to_uint(qkey.idx), cc.b2s(udpi, "udp", "tcp"), upstream.url },
+            );
+
+        nosuspend upstream.send(qmsg, qkey, false);
+
+        if (upstream.proto.is_udp())
+            Retransmit.add(qmsg, qkey, upstream, udpi, 0);
+    }
+
+    /// [retransmit] the best of the other upstreams (lowest srtt, not failing)
+    fn alternate(self: *Group, upstream: *const Upstream, udpi: bool) ?*Upstream {
+        var best: ?*Upstream = null;
+        for (self.items()) |*other| {
+            if (other == upstream or !other.accept_from(udpi) or other.circuit != .closed or other.is_failing())
+                continue;
+            if (best == null or other.srtt < best.?.srtt)
+                best = other;
+        }
+        return best;
+    }
+
+    /// the best two upstreams (lowest srtt, not failing). \
+    /// null if the estimates are uncertain, then send to all.
+    fn pick(self: *Group, udpi: bool) ?struct { best: *Upstream, second: ?*Upstream } {
+        self.query_n +%= 1;
+        if (self.query_n % EXPLORE_INTERVAL == 0)
+            return null;
+
+        var best: ?*Upstream = null;
+        var second: ?*Upstream = null;
+
+        for (self.items()) |*upstream| {
+            if (!upstream.accept_from(udpi)) continue;
 
-            nosuspend upstream.send(qmsg);
+            if (upstream.circuit != .closed) continue;
+
+            if (upstream.srtt == 0)
+                return null; // not measured yet
+
+            if (upstream.is_failing()) continue;
+
+            if (best == null or upstream.srtt < best.?.srtt) {
+                second = best;
+                best = upstream;
+            } else if (second == null or upstream.srtt < second.?.srtt) {
+                second = upstream;
+            }
         }
+
+        return .{
+            .best = best orelse return null, // all are failing
+            .second = second,
+        };
     }
 };
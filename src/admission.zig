@@ -0,0 +1,129 @@
+//! admission control before forwarding the query to upstream:
+//! - `--client-qps`: per-client token bucket (REFUSED), also for the requesters of an in-flight query
+//! - `--max-pending`: global overload (stale cache, otherwise SERVFAIL)
+
+const std = @import("std");
+const g = @import("g.zig");
+const c = @import("c.zig");
+const cc = @import("cc.zig");
+const testing = std.testing;
+
+// ======================================================
+
+pub const Reason = enum {
+    rate_limit, // the client has no tokens
+    overload, // too many pending queries
+    waiters, // too many requesters of the same in-flight query (singleflight)
+
+    /// rcode of the reply to the shed query
+    pub fn rcode(self: Reason) u8 {
+        return switch (self) {
+            .rate_limit, .waiters => c.DNS_RCODE_REFUSED,
+            .overload => c.DNS_RCODE_SERVFAIL,
+        };
+    }
+};
+
+/// [check_timeout] updated every loop iteration
+var _overloaded: bool = false;
+
+/// under pressure: answer from stale cache (whatever the expired time)
+pub inline fn overloaded() bool {
+    return _overloaded;
+}
+
+/// [check_timeout] `oldest_age`: age of the oldest pending query (ms)
+pub fn update(pending_n: usize, oldest_age: u64) void {
+    const max = g.max_pending;
+    if (max == 0) return;
+
+    // full, or half full and the upstream is slow to respond
+    const slow = oldest_age * 2 >= cc.to_u64(g.upstream_timeout) * 1000;
+    _overloaded = pending_n >= max or (pending_n * 2 >= max and slow);
+}
+
+/// [on_query] null means the client has a token (before joining an in-flight query)
+pub fn check_client(src_addr: *const cc.SockAddr) ?Reason {
+    if (g.client_qps > 0 and !clients.take_token(src_addr))
+        return .rate_limit;
+    return null;
+}
+
+/// [on_query] null means the query can be forwarded
+pub fn check_pending(pending_n: usize) ?Reason {
+    if (_overloaded or (g.max_pending > 0 and pending_n >= g.max_pending))
+        return .overload;
+    return null;
+}
+
+// ======================================================
+
+/// token buckets of the clients: direct-mapped table indexed by hash(ip). \
+/// bounded: a colliding client takes over the slot (with a full bucket).
+const clients = opaque {
+    const N = 4096;
+
+    const Client = struct {
+        ip: [c.IPV6_LEN]u8, // ipv4: ::ffff:a.b.c.d
+        time: u64, // last refill (ms), 0 means empty slot
+        tokens: u32,
+    };
+
+    var _clients: [N]Client = [_]Client{.{ .ip = undefined, .time = 0, .tokens = 0 }} ** N;
+
+    fn get_ip(src_addr: *const cc.SockAddr, ip: *[c.IPV6_LEN]u8) void {
+        if (src_addr.is_sin()) {
+            std.mem.set(u8, ip[0..10], 0);
+            ip[10] = 0xff;
+            ip[11] = 0xff;
+            @memcpy(ip[12..], std.mem.asBytes(&src_addr.sin.sin_addr), c.IPV4_LEN);
+        } else {
+            @memcpy(ip, std.mem.asBytes(&src_addr.sin6.sin6_addr), c.IPV6_LEN);
+        }
+    }
+
+    fn take_token(src_addr: *const cc.SockAddr) bool {
+        var ip: [c.IPV6_LEN]u8 = undefined;
+        get_ip(src_addr, &ip);
+
+        const now = g.evloop.time;
+        const rate = g.client_qps;
+
+        const client = &_clients[cc.calc_hashv(&ip) & (N - 1)];
+        if (client.time == 0 or !std.mem.eql(u8, &client.ip, &ip)) {
+            client.* = .{ .ip = ip, .time = now, .tokens = rate };
+        } else {
+            const elapsed = now - client.time;
+            if (elapsed * rate >= 1000) {
+                const n = std.math.min(elapsed * rate / 1000, rate);
+                client.tokens = std.math.min(client.tokens + cc.to_u32(n), rate);
+                client.time = now;
+            }
+        }
+
+        if (client.tokens > 0) {
+            client.tokens -= 1;
+            return true;
+        }
+        return false;
+    }
+};
+
+// ======================================================
+
+pub fn @"test: client token bucket"() !void {
+    const old_qps = g.client_qps;
+    defer g.client_qps = old_qps;
+    g.client_qps = 2;
+    g.evloop.time = 1000;
+
+    const a = cc.SockAddr.from_text("192.168.1.2", 53);
+    const b = cc.SockAddr.from_text("192.168.1.3", 53);
+
+    try testing.expect(check_client(&a) == null);
+    try testing.expect(check_client(&a) == null);
+    try testing.expectEqual(@as(?Reason, .rate_limit), check_client(&a));
+
+    // another client has its own bucket
+    try testing.expect(check_client(&b) == null);
+}
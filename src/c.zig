@@ -19,6 +19,7 @@ pub usingnamespace @cImport({
     @cInclude("time.h");
     @cInclude("fcntl.h");
     @cInclude("sys/types.h");
+    @cInclude("sys/wait.h");
     @cInclude("sys/epoll.h");
     @cInclude("sys/socket.h");
     @cInclude("sys/mman.h");
@@ -33,6 +34,7 @@ pub usingnamespace @cImport({
     @cInclude("src/ipset.h");
     @cInclude("src/misc.h");
     @cInclude("src/wolfssl.h");
+    @cInclude("src/ktls.h");
 });
 
 /// assuming CHAR_BIT=8
@@ -5,8 +5,14 @@ const cc = @import("cc.zig");
 const dns = @import("dns.zig");
 const Node = @import("Node.zig");
 const CacheMsg = @import("CacheMsg.zig");
+const Tag = @import("tag.zig").Tag;
 const cache_ignore = @import("cache_ignore.zig");
 const log = @import("log.zig");
+const worker = @import("worker.zig");
+const stats = @import("stats.zig");
+const admission = @import("admission.zig");
+const groups = @import("groups.zig");
+const EvLoop = @import("EvLoop.zig");
 const assert = std.debug.assert;
 const Bytes = cc.Bytes;
 
@@ -111,13 +117,160 @@ const map = opaque {
     }
 };
 
-fn enabled() bool {
+/// popular entries, ordered by expire_time (min-heap)
+const prefetch_queue = opaque {
+    var _heap: std.ArrayListUnmanaged(*CacheMsg) = .{};
+
+    fn less(a: *const CacheMsg, b: *const CacheMsg) bool {
+        return a.expire_time() < b.expire_time();
+    }
+
+    fn set(idx: usize, cmsg: *CacheMsg) void {
+        _heap.items[idx] = cmsg;
+        cmsg.prefetch_idx = cc.to_u32(idx);
+    }
+
+    fn sift_up(in_idx: usize) void {
+        var idx = in_idx;
+        const cmsg = _heap.items[idx];
+        while (idx > 0) {
+            const parent = (idx - 1) / 2;
+            if (!less(cmsg, _heap.items[parent])) break;
+            set(idx, _heap.items[parent]);
+            idx = parent;
+        }
+        set(idx, cmsg);
+    }
+
+    fn sift_down(in_idx: usize) void {
+        var idx = in_idx;
+        const cmsg = _heap.items[idx];
+        const n = _heap.items.len;
+        while (true) {
+            var child = idx * 2 + 1;
+            if (child >= n) break;
+            if (child + 1 < n and less(_heap.items[child + 1], _heap.items[child]))
+                child += 1;
+            if (!less(_heap.items[child], cmsg)) break;
+            set(idx, _heap.items[child]);
+            idx = child;
+        }
+        set(idx, cmsg);
+    }
+
+    fn top() ?*CacheMsg {
+        return if (_heap.items.len > 0) _heap.items[0] else null;
+    }
+
+    fn add(cmsg: *CacheMsg) void {
+        assert(cmsg.prefetch_idx == null);
+        _heap.append(g.allocator, cmsg) catch unreachable;
+        sift_up(_heap.items.len - 1);
+    }
+
+    /// no-op if not queued
+    fn del(cmsg: *CacheMsg) void {
+        const idx = cmsg.prefetch_idx orelse return;
+        cmsg.prefetch_idx = null;
+
+        const last = _heap.pop();
+        if (last == cmsg) return;
+
+        set(idx, last);
+        sift_up(idx);
+        sift_down(last.prefetch_idx.?);
+    }
+};
+
+/// min hits (since the last update) to be a popular entry
+const PREFETCH_MIN_HITS = 3;
+
+/// token bucket of the prefetch rate (`g.cache_prefetch` per second)
+var _prefetch_tokens: u32 = 0;
+var _prefetch_time: u64 = 0; // monotonic time (ms)
+
+pub fn enabled() bool {
     return g.cache_size > 0;
 }
 
+fn prefetch_enabled() bool {
+    return enabled() and g.cache_prefetch > 0;
+}
+
 fn del_nofree(cache_msg: *CacheMsg) void {
     map.del(cache_msg);
     cache_msg.node.unlink();
+    prefetch_queue.del(cache_msg);
+}
+
+/// count the hit, queue the entry for prefetch if it's popular \
+/// (again if the last prefetch did not update it)
+fn on_hit(cache_msg: *CacheMsg) void {
+    if (cache_msg.prefetched) {
+        cache_msg.prefetched = false;
+        stats.prefetch_hits += 1;
+    }
+
+    cache_msg.hits +|= 1;
+
+    if (prefetch_enabled() and cache_msg.hits >= PREFETCH_MIN_HITS and
+        !cache_msg.prefetching and cache_msg.prefetch_idx == null)
+        prefetch_queue.add(cache_msg);
+}
+
+fn take_prefetch_token(timer: *EvLoop.Timer) bool {
+    const now = g.evloop.time;
+    const rate = g.cache_prefetch;
+
+    const elapsed = now - _prefetch_time;
+    if (elapsed * rate >= 1000) {
+        const n = std.math.min(elapsed * rate / 1000, rate);
+        _prefetch_tokens = std.math.min(_prefetch_tokens + cc.to_u32(n), rate);
+        _prefetch_time = now;
+    }
+
+    if (_prefetch_tokens > 0) {
+        _prefetch_tokens -= 1;
+        return true;
+    }
+
+    _ = timer.check_deadline(_prefetch_time + (@as(u64, 1000) + rate - 1) / rate);
+    return false;
+}
+
+/// [check_timeout] return the entry to be refreshed (with the prefetch query)
+pub fn next_prefetch(timer: *EvLoop.Timer) ?*const CacheMsg {
+    if (!prefetch_enabled() or admission.overloaded())
+        return null;
+
+    const cache_msg = prefetch_queue.top() orelse return null;
+
+    // leave enough time for the upstream to reply
+    const due = cache_msg.expire_time() - g.upstream_timeout - 1;
+    const now = cc.time();
+    if (now < due) {
+        _ = timer.check_deadline(g.evloop.time + cc.to_u64(due - now) * 1000);
+        return null;
+    }
+
+    if (!take_prefetch_token(timer))
+        return null;
+
+    prefetch_queue.del(cache_msg);
+    cache_msg.prefetching = true;
+    stats.prefetches += 1;
+
+    return cache_msg;
+}
+
+/// [prefetch] the prefetch query is completed: replied (the entry may be unchanged),
+/// timed out, or not sent at all
+pub fn end_prefetch(question: []const u8) void {
+    if (!enabled())
+        return;
+
+    const cache_msg = map.get(question, cc.calc_hashv(question)) orelse return;
+    cache_msg.prefetching = false;
 }
 
 /// not expired or stale cache
@@ -125,10 +278,27 @@ fn ttl_ok(ttl: i32) bool {
     return ttl > 0 or (g.cache_stale > 0 and -ttl <= g.cache_stale);
 }
 
-/// return the cached reply msg
+/// under pressure (or the upstreams are down), any expired cache is better than SERVFAIL
+fn use_expired(tag: Tag) bool {
+    if (admission.overloaded()) {
+        stats.shed_stale += 1;
+        return true;
+    }
+    if (groups.is_down(tag)) {
+        stats.circuit_stale += 1;
+        return true;
+    }
+    return false;
+}
+
+/// return the cached reply msg \
+/// `tag`: the tag of the question, stamped on the entry \
+/// `tag == null`: fast lane (before the dnl lookup), hit only if the entry's tag is known
 pub fn get(
     qmsg: []const u8,
     qnamelen: c_int,
+    tag: ?Tag,
+    p_tag: *Tag,
     p_ttl: *i32,
     p_ttl_r: *i32,
     p_add_ip: *bool,
@@ -140,6 +310,14 @@ pub fn get(
     const hashv = cc.calc_hashv(question);
     const cache_msg = map.get(question, hashv) orelse return null;
 
+    if (tag) |t| {
+        cache_msg.tag = t;
+    } else if (cache_msg.tag == null) {
+        // fast lane: the tag is unknown, let the caller take the slow path
+        return null;
+    }
+    p_tag.* = cache_msg.tag.?;
+
     // update ttl
     const ttl = cache_msg.update_ttl();
     p_ttl.* = ttl;
@@ -151,19 +329,36 @@ pub fn get(
         break :b true;
     } else false;
 
-    if (ttl_ok(ttl)) {
+    if (ttl_ok(ttl) or use_expired(cache_msg.tag.?)) {
         // not expired or stale cache
         _list.move_to_head(&cache_msg.node);
+        on_hit(cache_msg);
         return cache_msg.msg();
     } else {
-        // expired
-        del_nofree(cache_msg);
-        cache_msg.free();
+        // expired (keep it for the fallback)
+        if (!groups.get_fallback(cache_msg.tag.?).stale) {
+            del_nofree(cache_msg);
+            cache_msg.free();
+        }
         return null;
     }
 }
 
-pub fn add(msg: []u8, qnamelen: c_int, p_ttl: *i32) bool {
+/// [fallback] the cached reply msg, even if expired
+pub fn get_stale(qmsg: []const u8, qnamelen: c_int) ?[]const u8 {
+    if (!enabled())
+        return null;
+
+    const question = dns.question(qmsg, qnamelen);
+    const cache_msg = map.get(question, cc.calc_hashv(question)) orelse return null;
+
+    _ = cache_msg.update_ttl();
+    _list.move_to_head(&cache_msg.node);
+
+    return cache_msg.msg();
+}
+
+pub fn add(msg: []u8, qnamelen: c_int, tag: Tag, p_ttl: *i32) bool {
     if (!enabled())
         return false;
 
@@ -183,8 +378,11 @@ pub fn add(msg: []u8, qnamelen: c_int, p_ttl: *i32) bool {
             // avoid duplicate add
             const old_ttl = old.get_ttl();
             if (std.math.absCast(ttl - old_ttl) <= 2) return false;
+            const prefetching = old.prefetching;
             del_nofree(old);
-            break :b old.reuse(msg, qnamelen, ttl, hashv);
+            const refreshed = old.reuse(msg, qnamelen, ttl, hashv);
+            refreshed.prefetched = prefetching;
+            break :b refreshed;
         } else if (map._nitems < g.cache_size) {
             break :b CacheMsg.new(msg, qnamelen, ttl, hashv);
         } else {
@@ -194,6 +392,7 @@ pub fn add(msg: []u8, qnamelen: c_int, p_ttl: *i32) bool {
         }
     };
 
+    cache_msg.tag = tag;
     map.add(cache_msg);
     _list.link_to_head(&cache_msg.node);
 
@@ -205,7 +404,9 @@ pub fn load() void {
     assert(enabled());
 
     const src = @src();
-    const path = g.cache_db orelse return;
+
+    var pathbuf: [c.PATH_MAX]u8 = undefined;
+    const path = worker.db_path(g.cache_db orelse return, &pathbuf);
 
     const mem = cc.mmap_file(path) orelse {
         if (cc.errno() != c.ENOENT)
@@ -232,10 +433,11 @@ pub fn dump(event: enum { on_exit, on_manual }) void {
 
     const src = @src();
 
-    const path = g.cache_db orelse switch (event) {
+    var pathbuf: [c.PATH_MAX]u8 = undefined;
+    const path = worker.db_path(g.cache_db orelse switch (event) {
         .on_exit => return,
         .on_manual => "/tmp/chinadns@cache.db",
-    };
+    }, &pathbuf);
 
     var count: usize = 0;
 
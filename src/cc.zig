@@ -448,6 +448,31 @@ pub inline fn pipe2(fds: *[2]c_int, flags: c_int) ?void {
     return if (raw.pipe2(fds, flags) == -1) null;
 }
 
+/// return 0 in the child process
+pub inline fn fork() ?c.pid_t {
+    const raw = struct {
+        extern fn fork() c.pid_t;
+    };
+    const pid = raw.fork();
+    return if (pid >= 0) pid else null;
+}
+
+/// return 0 if no child has exited (WNOHANG)
+pub inline fn waitpid(pid: c.pid_t, status: ?*c_int, options: c_int) ?c.pid_t {
+    const raw = struct {
+        extern fn waitpid(pid: c.pid_t, status: ?*c_int, options: c_int) c.pid_t;
+    };
+    const res = raw.waitpid(pid, status, options);
+    return if (res >= 0) res else null;
+}
+
+pub inline fn kill(pid: c.pid_t, sig: c_int) ?void {
+    const raw = struct {
+        extern fn kill(pid: c.pid_t, sig: c_int) c_int;
+    };
+    return if (raw.kill(pid, sig) == -1) null;
+}
+
 pub inline fn socket(family: c_int, type_: c_int, protocol: c_int) ?c_int {
     const raw = struct {
         extern fn socket(family: c_int, type: c_int, protocol: c_int) c_int;
@@ -865,6 +890,14 @@ pub fn SSL_set_host(ssl: *c.WOLFSSL, host: ?ConstStr, cert_verify: bool) ?void {
     c.wolfSSL_set_verify(ssl, mode, null);
 }
 
+/// tls_ext: ALPN (ClientHello), the handshake fails if the server doesn't support it
+pub fn SSL_set_alpn(ssl: *c.WOLFSSL, protocol: [:0]const u8) ?void {
+    var buf: [32]u8 = undefined;
+    std.mem.copy(u8, &buf, protocol);
+    const res = c.wolfSSL_UseALPN(ssl, &buf, to_uint(protocol.len), @intCast(u8, c.WOLFSSL_ALPN_FAILED_ON_MISMATCH));
+    return if (res == 1) {} else null;
+}
+
 /// for SSL I/O operation
 fn SSL_get_error(ssl: *c.WOLFSSL, res: c_int) c_int {
     var err = c.wolfSSL_get_error(ssl, res);
@@ -889,6 +922,49 @@ pub fn SSL_connect(ssl: *c.WOLFSSL, p_err: *c_int) ?void {
     }
 }
 
+/// the session (ticket) for resumption, null if not available \
+/// the returned session is ref-counted, free it with `SSL_SESSION_free`
+pub fn SSL_get1_session(ssl: *c.WOLFSSL) ?*c.WOLFSSL_SESSION {
+    return c.wolfSSL_get1_session(ssl);
+}
+
+pub fn SSL_SESSION_free(session: *c.WOLFSSL_SESSION) void {
+    return c.wolfSSL_SESSION_free(session);
+}
+
+/// resume the session on the next SSL_connect (before the handshake)
+pub fn SSL_set_session(ssl: *c.WOLFSSL, session: *c.WOLFSSL_SESSION) ?void {
+    return if (c.wolfSSL_set_session(ssl, session) == 1) {} else null;
+}
+
+/// the server accepts 0-RTT data for this session (tls13)
+pub fn SSL_SESSION_allow_early_data(session: *const c.WOLFSSL_SESSION) bool {
+    return c.wolfSSL_SESSION_get_max_early_data(session) > 0;
+}
+
+/// the handshake resumed a previous session
+pub fn SSL_session_reused(ssl: *c.WOLFSSL) bool {
+    return c.wolfSSL_session_reused(ssl) == 1;
+}
+
+/// send the data as 0-RTT, then continue the handshake with SSL_connect \
+/// `p_err`: to save the failure reason (SSL_ERROR_*)
+pub fn SSL_write_early_data(ssl: *c.WOLFSSL, buf: []const u8, p_err: *c_int) ?void {
+    var n: c_int = 0;
+    const res = c.wolfSSL_write_early_data(ssl, buf.ptr, to_int(buf.len), &n);
+    if (res > 0) {
+        return {};
+    } else {
+        p_err.* = SSL_get_error(ssl, res);
+        return null;
+    }
+}
+
+/// the 0-RTT data was accepted by the server (after the handshake)
+pub fn SSL_early_data_accepted(ssl: *const c.WOLFSSL) bool {
+    return c.wolfSSL_get_early_data_status(ssl) == c.WOLFSSL_EARLY_DATA_ACCEPTED;
+}
+
 /// the name of the protocol used for the connection
 pub fn SSL_get_version(ssl: *const c.WOLFSSL) ConstStr {
     return c.wolfSSL_get_version(ssl);
@@ -319,6 +319,189 @@ u16 dns_get_bufsz(const void *noalias msg, ssize_t len, int qnamelen) {
     return bufsz;
 }
 
+static bool set_bufsz(struct dns_record *noalias record, int rnamelen, void *ud, bool *noalias is_break) {
+    (void)rnamelen;
+
+    if (ntohs(record->rtype) == DNS_TYPE_OPT) {
+        record->rclass = htons(*(u16 *)ud);
+        *(u16 *)ud = 0; /* found */
+        *is_break = true;
+    }
+
+    return true;
+}
+
+u16 dns_set_bufsz(void *noalias msg, ssize_t len, int qnamelen, u16 bufsz, size_t cap) {
+    void *start = msg;
+    ssize_t msglen = len;
+
+    int answer_count = get_answer_count(msg);
+    int authority_count = get_authority_count(msg);
+    int additional_count = get_additional_count(msg);
+
+    /* move to answer section */
+    move_to_records(msg, len, qnamelen);
+
+    /* skip answer && authority section */
+    unlikely_if (!skip_record(&msg, &len, answer_count + authority_count))
+        return 0;
+
+    /* rewrite the OPT RR */
+    u16 ud = bufsz;
+    unlikely_if (!foreach_record(&msg, &len, additional_count, set_bufsz, &ud))
+        return 0;
+
+    if (ud == 0)
+        return msglen;
+
+    /* no OPT RR: append it to the end of the records (drop the trailing bytes) */
+    size_t newlen = (msg - start) + 1 + sizeof(struct dns_record);
+    unlikely_if (newlen > cap || additional_count >= 0xffff)
+        return 0;
+
+    *(ubyte *)msg = 0; /* root domain */
+    struct dns_record *record = msg + 1;
+    record->rtype = htons(DNS_TYPE_OPT);
+    record->rclass = htons(bufsz);
+    record->rttl = 0; /* extended-rcode, version, flags */
+    record->rdatalen = 0;
+
+    cast(struct dns_header *, start)->additional_count = htons(additional_count + 1);
+
+    return newlen;
+}
+
+/* EDNS option: edns-tcp-keepalive (RFC 7828) */
+#define DNS_OPT_TCP_KEEPALIVE 11
+
+static bool get_opt(struct dns_record *noalias record, int rnamelen, void *ud, bool *noalias is_break) {
+    (void)rnamelen;
+    (void)is_break;
+
+    /* the last one (not break), then the records are all walked through */
+    if (ntohs(record->rtype) == DNS_TYPE_OPT)
+        *(struct dns_record **)ud = record;
+
+    return true;
+}
+
+/* the msg has not been checked (reply from the upstream) */
+static bool find_opt(void *noalias msg, ssize_t len, struct dns_record **noalias p_opt, void **noalias p_end) {
+    unlikely_if (len < (ssize_t)DNS_MSG_MINSIZE)
+        return false;
+
+    const void *p = memchr(msg + sizeof(struct dns_header), 0, len - sizeof(struct dns_header));
+    unlikely_if (!p)
+        return false;
+
+    int qnamelen = p + 1 - (msg + sizeof(struct dns_header));
+    unlikely_if (len < (ssize_t)msg_minlen(qnamelen))
+        return false;
+
+    int answer_count = get_answer_count(msg);
+    int authority_count = get_authority_count(msg);
+    int additional_count = get_additional_count(msg);
+
+    /* move to answer section */
+    move_to_records(msg, len, qnamelen);
+
+    /* skip answer && authority section */
+    unlikely_if (!skip_record(&msg, &len, answer_count + authority_count))
+        return false;
+
+    *p_opt = NULL;
+    unlikely_if (!foreach_record(&msg, &len, additional_count, get_opt, p_opt))
+        return false;
+
+    *p_end = msg;
+    return true;
+}
+
+/* the option in the rdata of the OPT RR: code(2) + len(2) + data */
+static const ubyte *find_option(const struct dns_record *noalias opt, u16 code) {
+    const ubyte *p = (const ubyte *)opt->rdata;
+    int len = ntohs(opt->rdatalen);
+
+    while (len >= 4) {
+        u16 optcode = (p[0] << 8) | p[1];
+        int optlen = 4 + ((p[2] << 8) | p[3]);
+        unlikely_if (optlen > len)
+            break;
+        if (optcode == code)
+            return p;
+        p += optlen;
+        len -= optlen;
+    }
+
+    return NULL;
+}
+
+u16 dns_add_tcp_keepalive(void *noalias msg, ssize_t len, size_t cap) {
+    struct dns_record *opt;
+    void *end;
+    unlikely_if (!find_opt(msg, len, &opt, &end))
+        return 0;
+
+    /* drop the trailing bytes */
+    size_t msglen = end - msg;
+
+    if (opt && find_option(opt, DNS_OPT_TCP_KEEPALIVE))
+        return msglen;
+
+    ubyte *option;
+    size_t newlen;
+
+    if (opt) {
+        /* the option is appended to the rdata, the OPT RR must be the last record */
+        unlikely_if ((void *)opt->rdata + ntohs(opt->rdatalen) != end)
+            return 0;
+
+        newlen = msglen + 4;
+        unlikely_if (newlen > cap)
+            return 0;
+
+        opt->rdatalen = htons(ntohs(opt->rdatalen) + 4);
+        option = end;
+    } else {
+        int additional_count = get_additional_count(msg);
+
+        newlen = msglen + 1 + sizeof(struct dns_record) + 4;
+        unlikely_if (newlen > cap || additional_count >= 0xffff)
+            return 0;
+
+        *(ubyte *)end = 0; /* root domain */
+        struct dns_record *record = end + 1;
+        record->rtype = htons(DNS_TYPE_OPT);
+        record->rclass = htons(DNS_EDNS_MINSIZE);
+        record->rttl = 0; /* extended-rcode, version, flags */
+        record->rdatalen = htons(4);
+
+        cast(struct dns_header *, msg)->additional_count = htons(additional_count + 1);
+        option = (ubyte *)record->rdata;
+    }
+
+    /* no timeout in the query */
+    option[0] = 0;
+    option[1] = DNS_OPT_TCP_KEEPALIVE;
+    option[2] = 0;
+    option[3] = 0;
+
+    return newlen;
+}
+
+int dns_get_tcp_keepalive(const void *noalias msg, ssize_t len) {
+    struct dns_record *opt;
+    void *end;
+    unlikely_if (!find_opt((void *)msg, len, &opt, &end) || !opt)
+        return -1;
+
+    const ubyte *option = find_option(opt, DNS_OPT_TCP_KEEPALIVE);
+    unlikely_if (!option || ((option[2] << 8) | option[3]) < 2)
+        return -1;
+
+    return (option[4] << 8) | option[5];
+}
+
 u8 dns_get_rcode(const void *noalias msg) {
     return cast(const struct dns_header *, msg)->rcode;
 }
@@ -359,6 +542,12 @@ u16 dns_empty_reply(void *noalias msg, int qnamelen) {
     return qnamelen > 0 ? msg_minlen(qnamelen) : sizeof(struct dns_header);
 }
 
+u16 dns_error_reply(void *noalias msg, int qnamelen, u8 rcode) {
+    u16 len = dns_empty_reply(msg, qnamelen);
+    cast(struct dns_header *, msg)->rcode = rcode;
+    return len;
+}
+
 // return newlen (0 if failed)
 static u16 rm_additional(void *noalias msg, ssize_t len, int qnamelen) {
     if (!dns_is_good(msg))
@@ -639,6 +828,24 @@ bool dns_wire_to_ascii(const char *noalias wire_name, int wire_len, char buf[noa
     return decode_name(buf, wire_name, wire_len);
 }
 
+u16 dns_make_query(void *noalias qmsg, const void *noalias rmsg, int qnamelen) {
+    memcpy(qmsg, rmsg, msg_minlen(qnamelen));
+
+    struct dns_header *h = qmsg;
+    h->qr = DNS_QR_QUERY;
+    h->aa = 0;
+    h->tc = 0;
+    h->rd = 1;
+    h->ra = 0;
+    h->z = 0;
+    h->rcode = DNS_RCODE_NOERROR;
+    h->answer_count = 0;
+    h->authority_count = 0;
+    h->additional_count = 0;
+
+    return msg_minlen(qnamelen);
+}
+
 void dns_make_reply(void *noalias rmsg, const void *noalias qmsg, int qnamelen, const void *noalias answer, size_t answerlen, u16 answer_n) {
     memcpy(rmsg, qmsg, msg_minlen(qnamelen));
 
@@ -28,7 +28,9 @@
 #define DNS_QR_REPLY 1
 
 #define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_SERVFAIL 2
 #define DNS_RCODE_NXDOMAIN 3
+#define DNS_RCODE_REFUSED 5
 
 #define DNS_CLASS_IN 1
 
@@ -58,6 +60,15 @@ u16 dns_get_qtype(const void *noalias msg, int qnamelen);
 /* get the peer's udp receive buffer size from the `OPT RR` */
 u16 dns_get_bufsz(const void *noalias msg, ssize_t len, int qnamelen);
 
+/* set the udp payload size of the `OPT RR` (append it if not exists), return newlen (0 if failed) */
+u16 dns_set_bufsz(void *noalias msg, ssize_t len, int qnamelen, u16 bufsz, size_t cap);
+
+/* append the edns-tcp-keepalive option (RFC 7828) to the `OPT RR` (append it if not exists), return newlen (0 if failed) */
+u16 dns_add_tcp_keepalive(void *noalias msg, ssize_t len, size_t cap);
+
+/* the idle timeout (in units of 100ms) of the edns-tcp-keepalive option, -1 if not found */
+int dns_get_tcp_keepalive(const void *noalias msg, ssize_t len);
+
 u8 dns_get_rcode(const void *noalias msg);
 
 bool dns_is_tc(const void *noalias msg);
@@ -74,6 +85,9 @@ u16 dns_truncate(const void *noalias msg, ssize_t len, void *noalias out);
 /* keep only the HEADER and QUESTION section */
 u16 dns_empty_reply(void *noalias msg, int qnamelen);
 
+/* empty reply with the given rcode (e.g. SERVFAIL) */
+u16 dns_error_reply(void *noalias msg, int qnamelen, u8 rcode);
+
 /* check query msg, `ascii_name` used to get domain name */
 bool dns_check_query(void *noalias msg, ssize_t len, char *noalias ascii_name, int *noalias p_qnamelen);
 
@@ -112,4 +126,7 @@ size_t dns_ascii_to_wire(const char *noalias ascii_name, size_t ascii_len, char
 
 bool dns_wire_to_ascii(const char *noalias wire_name, int wire_len, char buf[noalias DNS_NAME_MAXLEN + 1]);
 
+/* make a query msg from the reply msg (header + question), return the len of qmsg */
+u16 dns_make_query(void *noalias qmsg, const void *noalias rmsg, int qnamelen);
+
 void dns_make_reply(void *noalias rmsg, const void *noalias qmsg, int qnamelen, const void *noalias answer, size_t answerlen, u16 answer_n);
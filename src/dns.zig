@@ -35,6 +35,24 @@ pub inline fn get_bufsz(msg: []const u8, qnamelen: c_int) u16 {
     return c.dns_get_bufsz(msg.ptr, cc.to_isize(msg.len), qnamelen);
 }
 
+/// `buf`: the whole buffer of the msg (the OPT RR may be appended) \
+/// return the new length of the msg (0 if failed)
+pub inline fn set_bufsz(buf: []u8, len: usize, qnamelen: c_int, bufsz: u16) u16 {
+    return c.dns_set_bufsz(buf.ptr, cc.to_isize(len), qnamelen, bufsz, buf.len);
+}
+
+/// `buf`: the whole buffer of the msg (the OPT RR may be appended) \
+/// return the new length of the msg (0 if failed)
+pub inline fn add_tcp_keepalive(buf: []u8, len: usize) u16 {
+    return c.dns_add_tcp_keepalive(buf.ptr, cc.to_isize(len), buf.len);
+}
+
+/// the idle timeout (in units of 100ms) advertised by the upstream
+pub inline fn get_tcp_keepalive(msg: []const u8) ?u16 {
+    const timeout = c.dns_get_tcp_keepalive(msg.ptr, cc.to_isize(msg.len));
+    return if (timeout >= 0) cc.to_u16(timeout) else null;
+}
+
 pub inline fn get_rcode(msg: []const u8) u8 {
     return c.dns_get_rcode(msg.ptr);
 }
@@ -65,6 +83,12 @@ pub inline fn empty_reply(msg: []u8, qnamelen: c_int) []u8 {
     return msg[0..len];
 }
 
+/// return the updated msg (empty reply with the `rcode`)
+pub inline fn error_reply(msg: []u8, qnamelen: c_int, rcode: u8) []u8 {
+    const len = c.dns_error_reply(msg.ptr, qnamelen, rcode);
+    return msg[0..len];
+}
+
 /// check if the query msg is valid
 /// `ascii_name`: the buffer used to get the domain-name (ASCII-format)
 /// `p_qnamelen`: used to get the length of the domain-name (wire-format)
@@ -128,6 +152,11 @@ pub inline fn wire_to_ascii(wire_name: []const u8, p_buf: *[c.DNS_NAME_MAXLEN:0]
     return c.dns_wire_to_ascii(wire_name.ptr, cc.to_int(wire_name.len), p_buf);
 }
 
+/// return the query msg (header + question)
+pub inline fn make_query(qmsg: []u8, rmsg: []const u8, qnamelen: c_int) []u8 {
+    return qmsg[0..c.dns_make_query(qmsg.ptr, rmsg.ptr, qnamelen)];
+}
+
 pub inline fn make_reply(rmsg: []u8, qmsg: []const u8, qnamelen: c_int, answer: []const u8, answer_n: u16) void {
     return c.dns_make_reply(rmsg.ptr, qmsg.ptr, qnamelen, answer.ptr, answer.len, answer_n);
 }
@@ -17,6 +17,14 @@ pub var flags: packed struct {
     reuse_port: bool = false,
     noip_as_chnip: bool = false,
     gfwlist_first: bool = true,
+    worker_cpu_pin: bool = false,
+    worker_qname_hash: bool = false,
+    upstream_best: bool = false,
+    upstream_hedge: bool = false,
+    upstream_warm: bool = false,
+    edns_keepalive: bool = false,
+    tcp_fastopen: bool = false,
+    ktls: bool = false,
 } = .{};
 
 pub inline fn verbose() bool {
@@ -63,6 +71,9 @@ pub var cache_stale: u32 = 0;
 /// refresh current cache if TTL <= N(%)
 pub var cache_refresh: u8 = 0;
 
+/// prefetch the popular cache before it expires (max N per second, 0 means disable)
+pub var cache_prefetch: u16 = 0;
+
 /// good_msg && no-records
 pub var cache_nodata_ttl: i32 = 60;
 
@@ -81,6 +92,18 @@ pub var verdict_cache_size: u16 = 0;
 /// load/dump verdict cache from/to this file
 pub var verdict_cache_db: ?cc.ConstStr = null;
 
+/// max forwarded queries per second of each client ip (0 means disable)
+pub var client_qps: u32 = 0;
+
+/// overload if N queries are pending (0 means disable)
+pub var max_pending: u32 = 0;
+
+/// udp payload size (EDNS) of the query sent to upstream (0 means as is)
+pub var edns_bufsz: u16 = 0;
+
+/// number of worker processes (0/1 means worker mode is disabled)
+pub var worker_n: u8 = 0;
+
 pub var evloop: EvLoop = undefined;
 
 /// global memory allocator
@@ -9,6 +9,7 @@ const ipset = @import("ipset.zig");
 const Tag = @import("tag.zig").Tag;
 const DynStr = @import("DynStr.zig");
 const StrList = @import("StrList.zig");
+const str2int = @import("str2int.zig");
 const Upstream = @import("Upstream.zig");
 const IP6Filter = @import("ip6_filter.zig").IP6Filter;
 const assert = std.debug.assert;
@@ -24,6 +25,20 @@ const Group = struct {
     ipset_name46: DynStr = .{}, // add ip to ipset/nftset
     ipset_addctx: ?*ipset.addctx_t = null,
     ip6_filter: IP6Filter = .{},
+    fallback: Fallback = .{},
+};
+
+/// [`--fallback`] the upstreams of the group don't reply in time, or reply SERVFAIL/REFUSED
+pub const Fallback = struct {
+    tag: ?Tag = null, // re-dispatch the query to this group
+    stale: bool = false, // answer from the expired cache
+    delay: u32 = 0, // ms, 0 means only on SERVFAIL/REFUSED
+
+    pub const DEFAULT_DELAY = 1000;
+
+    pub inline fn enabled(self: *const Fallback) bool {
+        return self.tag != null or self.stale;
+    }
 };
 
 fn get(tag: Tag) *Group {
@@ -46,6 +61,19 @@ pub inline fn get_ip6_filter(tag: Tag) IP6Filter {
     return get(tag).ip6_filter;
 }
 
+pub inline fn get_fallback(tag: Tag) *const Fallback {
+    return &get(tag).fallback;
+}
+
+/// the upstreams of the tag are all out of rotation (circuit open) \
+/// tag:none: the china or trust upstreams
+pub fn is_down(tag: Tag) bool {
+    return switch (tag) {
+        .none => get_upstream_group(.chn).is_down() or get_upstream_group(.gfw).is_down(),
+        else => get_upstream_group(tag).is_down(),
+    };
+}
+
 // ========================================================
 
 /// for opt.zig
@@ -113,6 +141,51 @@ pub noinline fn add_ip6_filter(rules: ?[]const u8) ?void {
     }
 }
 
+/// for opt.zig: "<tag>=<tag|stale>[,stale][@ms]"
+pub noinline fn set_fallback(value: []const u8) ?void {
+    const sep = std.mem.indexOfScalar(u8, value, '=') orelse return null;
+
+    const tag = Tag.from_name(cc.to_cstr(value[0..sep])) orelse {
+        opt.print(@src(), "invalid tag", value[0..sep]);
+        return null;
+    };
+    if (tag.is_null())
+        return null;
+
+    var fallback: Fallback = .{ .delay = Fallback.DEFAULT_DELAY };
+
+    var targets = value[sep + 1 ..];
+    if (std.mem.indexOfScalar(u8, targets, '@')) |i| {
+        fallback.delay = str2int.parse(u32, targets[i + 1 ..], 10) orelse return null;
+        targets = targets[0..i];
+    }
+
+    var it = std.mem.split(u8, targets, ",");
+    while (it.next()) |target| {
+        if (std.mem.eql(u8, target, "stale")) {
+            fallback.stale = true;
+            continue;
+        }
+
+        const fallback_tag = Tag.from_name(cc.to_cstr(target)) orelse {
+            opt.print(@src(), "invalid tag", target);
+            return null;
+        };
+
+        // tag:none is sent to chn and gfw already
+        if (fallback.tag != null or fallback_tag == tag or fallback_tag == .none or fallback_tag.is_null() or
+            (tag == .none and (fallback_tag == .chn or fallback_tag == .gfw)))
+        {
+            opt.print(@src(), "invalid fallback", target);
+            return null;
+        }
+
+        fallback.tag = fallback_tag;
+    }
+
+    get(tag).fallback = fallback;
+}
+
 // ========================================================
 
 /// for main.zig
@@ -150,7 +223,9 @@ pub fn on_start() void {
 
                 for (group.upstream_group.items()) |*upstream| {
                     log.info(src, "tag:%s upstream: %s", .{ tag.name(), upstream.url });
-                    has_tls_upstream = has_tls_upstream or upstream.proto == .tls;
+                    has_tls_upstream = has_tls_upstream or upstream.proto.is_tls();
+                    if (g.flags.upstream_warm)
+                        upstream.warm_up();
                 }
 
                 // [ipset]
@@ -161,6 +236,21 @@ pub fn on_start() void {
                 }
             }
 
+            // [fallback]
+            if (group.fallback.enabled()) {
+                if (group.fallback.tag) |fallback_tag| {
+                    if (get_upstream_group(fallback_tag).is_empty())
+                        break :e .{ .tag = tag, .msg = "fallback group has no upstream" };
+                }
+                log.info(src, "tag:%s fallback: %s%s%s delay:%ums", .{
+                    tag.name(),
+                    if (group.fallback.tag) |fallback_tag| fallback_tag.name() else "",
+                    cc.b2s(group.fallback.tag != null and group.fallback.stale, ",", ""),
+                    cc.b2s(group.fallback.stale, "stale", ""),
+                    cc.to_uint(group.fallback.delay),
+                });
+            }
+
             // [ip6 filter]
             if (!tag.is_null()) {
                 if (group.ip6_filter.rule_desc()) |rule|
@@ -182,6 +272,14 @@ pub fn on_start() void {
     cc.exit(1);
 }
 
+/// SIGUSR1
+pub fn dump_upstream_stats() void {
+    for (_all_groups) |*group| {
+        for (group.upstream_group.items()) |*upstream|
+            upstream.dump_stats();
+    }
+}
+
 pub fn require_ip_test() bool {
     for (_all_groups) |*group| {
         if (group.ip6_filter.require_ip_test())
@@ -202,3 +300,21 @@ pub fn @"test: dnl.c"() !void {
         on_start();
     }
 }
+
+pub fn @"test: fallback"() !void {
+    defer get(.chn).fallback = .{};
+    defer get(.none).fallback = .{};
+
+    set_fallback("chn=gfw,stale@500").?;
+    try testing.expectEqual(@as(?Tag, .gfw), get_fallback(.chn).tag);
+    try testing.expect(get_fallback(.chn).stale);
+    try testing.expectEqual(@as(u32, 500), get_fallback(.chn).delay);
+
+    set_fallback("none=stale").?;
+    try testing.expectEqual(@as(?Tag, null), get_fallback(.none).tag);
+    try testing.expectEqual(@as(u32, Fallback.DEFAULT_DELAY), get_fallback(.none).delay);
+
+    try testing.expect(set_fallback("none=gfw") == null);
+    try testing.expect(set_fallback("chn=chn") == null);
+    try testing.expect(set_fallback("chn") == null);
+}
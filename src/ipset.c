@@ -586,6 +586,14 @@ static bool init(const char *noalias name46) {
     return is_ipset;
 }
 
+void ipset_on_fork(void) {
+    if (s_sock < 0) return;
+
+    /* the nlmsg_pid of the prepared msgs is not checked by the kernel */
+    close(s_sock);
+    s_sock = nl_sock_create(NETLINK_NETFILTER, &s_portid);
+}
+
 static void init_testctx(const struct ipset_testctx *noalias ctx,
     const char *noalias name4, const char *noalias name6,
     bool is_ipset, bool ack)
@@ -18,3 +18,6 @@ bool ipset_test_ip(const struct ipset_testctx *noalias ctx, const void *noalias
 void ipset_add_ip(struct ipset_addctx *noalias ctx, const void *noalias ip, bool v4);
 
 void ipset_end_add_ip(struct ipset_addctx *noalias ctx);
+
+/* re-create the netlink socket (in the child process) */
+void ipset_on_fork(void);
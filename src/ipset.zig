@@ -11,3 +11,8 @@ pub fn new_testctx(name46: cc.ConstStr) *const testctx_t {
 pub fn new_addctx(name46: cc.ConstStr) *addctx_t {
     return c.ipset_new_addctx(name46).?;
 }
+
+/// re-create the netlink socket (in the child process)
+pub fn on_fork() void {
+    return c.ipset_on_fork();
+}
@@ -0,0 +1,104 @@
+#ifdef ENABLE_WOLFSSL
+
+#define _GNU_SOURCE
+#include "ktls.h"
+#include "misc.h"
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+/* since linux 4.13 */
+#ifndef TCP_ULP
+  #define TCP_ULP 31
+#endif
+
+#ifndef SOL_TLS
+  #define SOL_TLS 282
+#endif
+
+static void set_rec_seq(u8 rec_seq[8], u64 seq) {
+    for (int i = 0; i < 8; ++i)
+        rec_seq[i] = seq >> (56 - i * 8);
+}
+
+/* after TLS_TX, a record written by wolfssl itself (alert, KeyUpdate reply, ...) would be
+   encrypted again by the kernel as application data, and the kernel stays on the old key.
+   refuse it: the SSL_read() that wants to write fails and the session is closed. */
+static int refuse_send(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
+    (void)ssl; (void)buf; (void)sz; (void)ctx;
+    errno = EPROTO;
+    return WOLFSSL_CBIO_ERR_GENERAL;
+}
+
+bool ktls_enable_tx(WOLFSSL *ssl, int fd) {
+    const bool tls13 = wolfSSL_version(ssl) == TLS1_3_VERSION;
+    const u16 version = tls13 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+
+    const unsigned char *key = wolfSSL_GetClientWriteKey(ssl);
+    const unsigned char *iv = wolfSSL_GetClientWriteIV(ssl);
+    const int keylen = wolfSSL_GetKeySize(ssl);
+    if (!key || !iv)
+        return false;
+
+    /* the first record after the handshake: tls13 starts a new key (seq 0), tls12 follows Finished (seq 1) */
+    u8 rec_seq[8];
+    set_rec_seq(rec_seq, tls13 ? 0 : 1);
+
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes128;
+        struct tls12_crypto_info_aes_gcm_256 aes256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+    } info;
+    socklen_t infolen;
+    memset(&info, 0, sizeof(info));
+
+    /* tls12 aes-gcm: the explicit nonce is chosen by the sender, use the seq as usual */
+    switch (wolfSSL_GetBulkCipher(ssl)) {
+        case wolfssl_aes_gcm:
+            if (keylen == TLS_CIPHER_AES_GCM_128_KEY_SIZE) {
+                info.aes128.info.version = version;
+                info.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+                memcpy(info.aes128.key, key, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+                memcpy(info.aes128.salt, iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+                memcpy(info.aes128.iv, tls13 ? iv + TLS_CIPHER_AES_GCM_128_SALT_SIZE : rec_seq, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+                memcpy(info.aes128.rec_seq, rec_seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+                infolen = sizeof(info.aes128);
+            } else if (keylen == TLS_CIPHER_AES_GCM_256_KEY_SIZE) {
+                info.aes256.info.version = version;
+                info.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+                memcpy(info.aes256.key, key, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+                memcpy(info.aes256.salt, iv, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+                memcpy(info.aes256.iv, tls13 ? iv + TLS_CIPHER_AES_GCM_256_SALT_SIZE : rec_seq, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+                memcpy(info.aes256.rec_seq, rec_seq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+                infolen = sizeof(info.aes256);
+            } else {
+                return false;
+            }
+            break;
+        case wolfssl_chacha:
+            info.chacha.info.version = version;
+            info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+            memcpy(info.chacha.key, key, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+            memcpy(info.chacha.iv, iv, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+            memcpy(info.chacha.rec_seq, rec_seq, TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+            infolen = sizeof(info.chacha);
+            break;
+        default:
+            return false;
+    }
+
+    /* without TLS_TX, the tls ulp just passes the data through */
+    if (setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) != 0)
+        return false;
+
+    if (setsockopt(fd, SOL_TLS, TLS_TX, &info, infolen) != 0)
+        return false;
+
+    wolfSSL_SSLSetIOSend(ssl, refuse_send);
+    return true;
+}
+
+#endif
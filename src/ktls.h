@@ -0,0 +1,15 @@
+#pragma once
+
+#ifdef ENABLE_WOLFSSL
+
+#include "wolfssl.h"
+#include <stdbool.h>
+
+/* kernel tls: hand the client write keys to the kernel (TCP_ULP "tls", TLS_TX).
+   must be called right after the handshake, before any wolfSSL_write().
+   on success, wolfssl can no longer write to the socket: a KeyUpdate request or an alert
+   to be sent makes the wolfSSL_read() fail (the session should be closed).
+   on failure, the socket is still usable by wolfssl. */
+bool ktls_enable_tx(WOLFSSL *ssl, int fd);
+
+#endif
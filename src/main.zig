@@ -16,6 +16,8 @@ const co = @import("co.zig");
 const groups = @import("groups.zig");
 const cache = @import("cache.zig");
 const verdict_cache = @import("verdict_cache.zig");
+const stats = @import("stats.zig");
+const worker = @import("worker.zig");
 const assert = std.debug.assert;
 
 // ============================================================================
@@ -87,7 +89,7 @@ fn sig_listener() void {
     // register signal handler
     _ = cc.signal(c.SIGINT, sig_handler); // CTRL C
     _ = cc.signal(c.SIGTERM, sig_handler); // kill <PID>
-    _ = cc.signal(c.SIGUSR1, sig_handler); // dump cache to file
+    _ = cc.signal(c.SIGUSR1, sig_handler); // dump cache to file, print counters
     if (_debug) _ = cc.signal(c.SIGUSR2, sig_handler); // detect memory leaks
 
     // listening for signal
@@ -108,6 +110,7 @@ fn sig_listener() void {
             c.SIGUSR1 => {
                 cache.dump(.on_manual);
                 verdict_cache.dump(.on_manual);
+                stats.dump();
             },
             c.SIGUSR2 => {
                 if (_debug)
@@ -189,6 +192,9 @@ pub fn main() u8 {
         if (g.cache_refresh > 0)
             log.info(src, "pre-refresh cache, remain TTL: %u%%", .{cc.to_uint(g.cache_refresh)});
 
+        if (g.cache_prefetch > 0)
+            log.info(src, "prefetch popular cache, max rate: %u/s", .{cc.to_uint(g.cache_prefetch)});
+
         if (g.cache_nodata_ttl > 0)
             log.info(src, "cache NODATA response, TTL: %ld", .{cc.to_long(g.cache_nodata_ttl)});
 
@@ -197,20 +203,42 @@ pub fn main() u8 {
 
         if (g.cache_max_ttl > 0)
             log.info(src, "cache TTL overwrite, max TTL: %ld", .{cc.to_long(g.cache_max_ttl)});
-
-        cache.load();
     }
 
     if (g.verdict_cache_size > 0) {
         log.info(src, "enable verdict cache, capacity: %u", .{cc.to_uint(g.verdict_cache_size)});
-
-        verdict_cache.load();
     }
 
     log.info(src, "response timeout of upstream: %u", .{cc.to_uint(g.upstream_timeout)});
 
     if (g.trustdns_packet_n > 1)
-        log.info(src, "num of packets to trustdns: %u", .{cc.to_uint(g.trustdns_packet_n)});
+        log.info(src, "max num of packets to trustdns: %u", .{cc.to_uint(g.trustdns_packet_n)});
+
+    if (g.flags.upstream_hedge)
+        log.info(src, "send query to the best upstream, hedge with the next one", .{})
+    else if (g.flags.upstream_best)
+        log.info(src, "send query to the best 1~2 upstreams of the group", .{});
+
+    if (g.flags.upstream_warm)
+        log.info(src, "keep the upstream sessions connected", .{});
+
+    if (g.flags.edns_keepalive)
+        log.info(src, "tcp/DoT upstream: session life by edns-tcp-keepalive", .{});
+
+    if (g.flags.tcp_fastopen)
+        log.info(src, "TCP Fast Open for tcp listener and upstream", .{});
+
+    if (g.flags.ktls)
+        log.info(src, "kernel TLS (tx) for DoT upstream", .{});
+
+    if (g.client_qps > 0)
+        log.info(src, "rate limit of each client ip: %u/s", .{cc.to_uint(g.client_qps)});
+
+    if (g.max_pending > 0)
+        log.info(src, "overload if pending queries >= %u", .{cc.to_uint(g.max_pending)});
+
+    if (g.edns_bufsz > 0)
+        log.info(src, "EDNS udp size of upstream query: %u", .{cc.to_uint(g.edns_bufsz)});
 
     if (g.default_tag == .none) {
         const action = cc.b2s(g.flags.noip_as_chnip, "accept", "filter");
@@ -220,11 +248,30 @@ pub fn main() u8 {
     if (g.flags.reuse_port)
         log.info(src, "SO_REUSEPORT for listening socket", .{});
 
+    if (worker.enabled()) {
+        log.info(src, "worker mode, num of workers: %u", .{cc.to_uint(g.worker_n)});
+
+        if (g.flags.worker_cpu_pin)
+            log.info(src, "pin worker-N to cpu-N", .{});
+
+        if (g.flags.worker_qname_hash)
+            log.info(src, "steer udp query to worker by qname hash", .{});
+    }
+
     if (g.verbose())
         log.info(src, "printing the verbose runtime log", .{});
 
     // ============================================================================
 
+    // the caller is the worker process (if worker mode is enabled)
+    worker.start();
+
+    if (g.cache_size > 0)
+        cache.load();
+
+    if (g.verdict_cache_size > 0)
+        verdict_cache.load();
+
     server.start();
 
     co.start(sig_listener, .{});
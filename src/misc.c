@@ -4,7 +4,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/prctl.h>
 
 void sig_register(int sig, sighandler_t handler) {
     struct sigaction act;
@@ -14,6 +18,42 @@ void sig_register(int sig, sighandler_t handler) {
     sigaction(sig, &act, NULL);
 }
 
+static void supervisor_sigset(sigset_t *set) {
+    sigemptyset(set);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGUSR1);
+    sigaddset(set, SIGUSR2);
+    sigaddset(set, SIGCHLD);
+}
+
+void sig_mask_supervisor(bool block) {
+    sigset_t set;
+    supervisor_sigset(&set);
+    sigprocmask(block ? SIG_BLOCK : SIG_UNBLOCK, &set, NULL);
+}
+
+int sig_wait_supervisor(void) {
+    sigset_t set;
+    supervisor_sigset(&set);
+    return retry_EINTR(sigwaitinfo(&set, NULL));
+}
+
+void set_pdeathsig(int sig) {
+    prctl(PR_SET_PDEATHSIG, sig);
+}
+
+bool set_cpu_affinity(int cpu) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n <= 0) n = 1;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % n, &set);
+
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
 const void *SIG_IGNORE(void) {
     return SIG_IGN;
 }
@@ -125,6 +125,18 @@ typedef u8 bitvec_t;
 
 void sig_register(int sig, sighandler_t handler);
 
+/* worker mode: block/unblock the signals handled by the supervisor */
+void sig_mask_supervisor(bool block);
+
+/* worker mode: wait for a blocked signal (see `sig_mask_supervisor`) */
+int sig_wait_supervisor(void);
+
+/* the calling process gets `sig` when the parent process exits */
+void set_pdeathsig(int sig);
+
+/* bind the calling process to the cpu (cpu % nprocs) */
+bool set_cpu_affinity(int cpu);
+
 const void *SIG_IGNORE(void);
 const void *SIG_DEFAULT(void);
 
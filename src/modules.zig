@@ -1,14 +1,18 @@
-pub const name_list = .{ "CacheMsg", "DynStr", "EvLoop", "Node", "Rc", "RcMsg", "StrList", "Upstream", "c", "cache", "cache_ignore", "cc", "co", "dnl", "dns", "fmtchk", "g", "groups", "ip6_filter", "ipset", "local_rr", "log", "main", "modules", "net", "opt", "sentinel_vector", "server", "str2int", "tag", "tests", "verdict_cache" };
-pub const module_list = .{ CacheMsg, DynStr, EvLoop, Node, Rc, RcMsg, StrList, Upstream, c, cache, cache_ignore, cc, co, dnl, dns, fmtchk, g, groups, ip6_filter, ipset, local_rr, log, main, modules, net, opt, sentinel_vector, server, str2int, tag, tests, verdict_cache };
+pub const name_list = .{ "CacheMsg", "DynStr", "EvLoop", "H2", "Node", "QidMap", "Rc", "RcMsg", "RecvBuf", "StrList", "Upstream", "admission", "c", "cache", "cache_ignore", "cc", "co", "dnl", "dns", "fmtchk", "g", "groups", "ip6_filter", "ipset", "local_rr", "log", "main", "modules", "net", "opt", "sentinel_vector", "server", "stats", "str2int", "tag", "tests", "verdict_cache", "worker" };
+pub const module_list = .{ CacheMsg, DynStr, EvLoop, H2, Node, QidMap, Rc, RcMsg, RecvBuf, StrList, Upstream, admission, c, cache, cache_ignore, cc, co, dnl, dns, fmtchk, g, groups, ip6_filter, ipset, local_rr, log, main, modules, net, opt, sentinel_vector, server, stats, str2int, tag, tests, verdict_cache, worker };
 
 const CacheMsg = @import("CacheMsg.zig");
 const DynStr = @import("DynStr.zig");
 const EvLoop = @import("EvLoop.zig");
+const H2 = @import("H2.zig");
 const Node = @import("Node.zig");
+const QidMap = @import("QidMap.zig");
 const Rc = @import("Rc.zig");
 const RcMsg = @import("RcMsg.zig");
+const RecvBuf = @import("RecvBuf.zig");
 const StrList = @import("StrList.zig");
 const Upstream = @import("Upstream.zig");
+const admission = @import("admission.zig");
 const c = @import("c.zig");
 const cache = @import("cache.zig");
 const cache_ignore = @import("cache_ignore.zig");
@@ -29,7 +33,9 @@ const net = @import("net.zig");
 const opt = @import("opt.zig");
 const sentinel_vector = @import("sentinel_vector.zig");
 const server = @import("server.zig");
+const stats = @import("stats.zig");
 const str2int = @import("str2int.zig");
 const tag = @import("tag.zig");
 const tests = @import("tests.zig");
 const verdict_cache = @import("verdict_cache.zig");
+const worker = @import("worker.zig");
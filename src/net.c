@@ -6,12 +6,33 @@
 #include <string.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
 
 /* since linux 3.9 */
 #ifndef SO_REUSEPORT
   #define SO_REUSEPORT 15
 #endif
 
+/* since linux 4.5 */
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+  #define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+/* since linux 3.7 */
+#ifndef TCP_FASTOPEN
+  #define TCP_FASTOPEN 23
+#endif
+
+/* since linux 4.11 */
+#ifndef TCP_FASTOPEN_CONNECT
+  #define TCP_FASTOPEN_CONNECT 30
+#endif
+
+#ifndef TCPI_OPT_SYN_DATA
+  #define TCPI_OPT_SYN_DATA 32
+#endif
+
 int (*RECVMMSG)(int sockfd, MMSGHDR *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
 
 int (*SENDMMSG)(int sockfd, MMSGHDR *msgvec, unsigned int vlen, int flags);
@@ -115,3 +136,64 @@ void epev_set_events(void *noalias ev, u32 events) {
 void epev_set_ptrdata(void *noalias ev, const void *ptrdata) {
     cast(struct epoll_event *, ev)->data.ptr = (void *)ptrdata;
 }
+
+/* number of qname bytes to hash (the rest is ignored) */
+#define STEER_QNAME_LEN 64
+
+/* FNV-1a */
+#define STEER_HASH_BASIS 2166136261U
+#define STEER_HASH_PRIME 16777619U
+
+/* insns per qname byte */
+#define STEER_STEP_N 7
+
+bool set_reuseport_qname_steering(int fd, uint sock_n) {
+    /* A: the current byte, X: hash value */
+    static struct sock_filter code[2 + STEER_QNAME_LEN * STEER_STEP_N + 3];
+    uint n = 0;
+
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_IMM, STEER_HASH_BASIS);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0);
+
+    /* the loaded data starts at the udp payload; qname starts at offset 12 */
+    const uint done = 2 + STEER_QNAME_LEN * STEER_STEP_N;
+    for (uint i = 0; i < STEER_QNAME_LEN; ++i) {
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 12 + i);
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1); /* end of qname */
+        code[n] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, done - (n + 1)); ++n;
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_OR | BPF_K, 0x20); /* ignore case (0x20 bit) */
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, STEER_HASH_PRIME);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0);
+    }
+    assert(n == done);
+
+    /* return the index of the socket in the reuseport group */
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TXA, 0);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, sock_n);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+    assert(n == array_n(code));
+
+    struct sock_fprog prog = {
+        .len = n,
+        .filter = code,
+    };
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+
+bool set_tcp_fastopen(int fd, int qlen) {
+    return setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) == 0;
+}
+
+bool set_tcp_fastopen_connect(int fd) {
+    int on = 1;
+    return setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) == 0;
+}
+
+bool is_tcp_syn_data_acked(int fd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+        return false;
+    return info.tcpi_options & TCPI_OPT_SYN_DATA;
+}
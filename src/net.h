@@ -54,6 +54,18 @@ extern int (*SENDMMSG)(int sockfd, MMSGHDR *msgvec, unsigned int vlen, int flags
 
 void net_init(void);
 
+/* udp listener: select the socket of the reuseport group by qname hash (cBPF) */
+bool set_reuseport_qname_steering(int fd, uint sock_n);
+
+/* tcp listener: accept the data carried by the SYN (tcp fastopen) */
+bool set_tcp_fastopen(int fd, int qlen);
+
+/* tcp client: connect() is deferred, the first write is carried by the SYN if the cookie is cached */
+bool set_tcp_fastopen_connect(int fd);
+
+/* tcp client: the data carried by the SYN was acked by the server */
+bool is_tcp_syn_data_acked(int fd);
+
 u32 epev_get_events(const void *noalias ev);
 void *epev_get_ptrdata(const void *noalias ev);
 
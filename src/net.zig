@@ -49,6 +49,11 @@ pub fn new_listen_sock(family: c.sa_family_t, socktype: SockType) ?c_int {
 pub fn new_tcp_conn_sock(family: c.sa_family_t) ?c_int {
     const fd = new_sock(family, .tcp) orelse return null;
     setup_tcp_conn_sock(fd);
+
+    // if not supported (linux < 4.11), it's just a normal connect
+    if (g.flags.tcp_fastopen)
+        _ = c.set_tcp_fastopen_connect(fd);
+
     return fd;
 }
 
@@ -80,6 +85,19 @@ fn setup_listen_sock(fd: c_int, family: c.sa_family_t) void {
         _ = setsockopt_int(fd, c.IPPROTO_IPV6, c.IPV6_V6ONLY, "IPV6_V6ONLY", 0);
 }
 
+/// udp listener of the worker: the same qname is always steered to the same worker. \
+/// if failed, the kernel's default hashing (4-tuple) is used.
+pub fn setup_qname_steering(fd: c_int, worker_n: u8) void {
+    if (!c.set_reuseport_qname_steering(fd, worker_n))
+        log.warn(@src(), "setsockopt(%d, SO_ATTACH_REUSEPORT_CBPF) failed, fallback to default hashing: (%d) %m", .{ fd, cc.errno() });
+}
+
+/// tcp listener: `--tcp-fastopen`, also requires `net.ipv4.tcp_fastopen` (bit 2)
+pub fn setup_tcp_fastopen(fd: c_int) void {
+    if (!c.set_tcp_fastopen(fd, 256))
+        log.warn(@src(), "setsockopt(%d, TCP_FASTOPEN) failed: (%d) %m", .{ fd, cc.errno() });
+}
+
 pub fn setup_tcp_conn_sock(fd: c_int) void {
     _ = setsockopt_int(fd, c.IPPROTO_TCP, c.TCP_NODELAY, "TCP_NODELAY", 1);
 
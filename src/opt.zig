@@ -10,6 +10,7 @@ const str2int = @import("str2int.zig");
 const Tag = @import("tag.zig").Tag;
 const cache_ignore = @import("cache_ignore.zig");
 const local_rr = @import("local_rr.zig");
+const worker = @import("worker.zig");
 const assert = std.debug.assert;
 
 const help =
@@ -40,6 +41,7 @@ const help =
     \\ --cache <size>                       enable dns caching, size 0 means disabled
     \\ --cache-stale <N>                    use stale cache: expired time <= N(second)
     \\ --cache-refresh <N>                  pre-refresh the cached data if TTL <= N(%)
+    \\ --cache-prefetch <N>                 prefetch popular cache before expiry, N/sec
     \\ --cache-nodata-ttl <ttl>             TTL of the NODATA response, default is 60
     \\ --cache-min-ttl <ttl>                if record.ttl < min_ttl, set ttl to min_ttl
     \\ --cache-max-ttl <ttl>                if record.ttl > max_ttl, set ttl to max_ttl
@@ -53,11 +55,24 @@ const help =
     \\ --ca-certs <path>                    CA certs path for SSL certificate validation
     \\ --no-ipset-blacklist                 add-ip: don't enable built-in ip blacklist
     \\                                      blacklist: 127.0.0.0/8, 0.0.0.0/8, ::1, ::
+    \\ --client-qps <N>                     rate limit of each client ip (REFUSED), N/sec
+    \\ --max-pending <N>                    overload if N queries pending: stale/SERVFAIL
+    \\ --edns-bufsize <size>                upstream query: set EDNS udp size, e.g. 1232
     \\ -o, --timeout-sec <sec>              response timeout of upstream, default: 5
-    \\ -p, --repeat-times <num>             num of packets to trustdns, default:1, max:5
+    \\ -p, --repeat-times <num>             max packets to trustdns, default:1, max:5
+    \\ --upstream-best                      send query to the best 1~2 upstreams by rtt
+    \\ --upstream-hedge                     best upstream first, 2nd if no reply by p95
+    \\ --upstream-warm                      pre-connect tcp/tls upstream, make-before-break
+    \\ --edns-keepalive                     tcp/DoT: session life by edns-tcp-keepalive
+    \\ --fallback <tag>=<tag,stale>[@ms]    fallback if SERVFAIL or no reply in ms(1000)
+    \\ --tcp-fastopen                       TCP Fast Open for tcp listener and upstream
+    \\ --ktls                               DoT: kernel TLS tx offload after the handshake
     \\ -n, --noip-as-chnip                  allow no-ip reply from chinadns (tag:none)
     \\ -f, --fair-mode                      enable fair mode (nop, only fair mode now)
     \\ -r, --reuse-port                     enable SO_REUSEPORT, default: <disabled>
+    \\ --workers <num>                      num of worker processes (SO_REUSEPORT)
+    \\ --worker-cpu-pin                     pin worker-N to cpu-N, default: <disabled>
+    \\ --worker-qname-hash                  udp: steer query to worker by qname hash
     \\ -v, --verbose                        print the verbose log, default: <disabled>
     \\ -V, --version                        print `chinadns-ng` version number and exit
     \\ -h, --help                           print `chinadns-ng` help information and exit
@@ -137,6 +152,7 @@ const optdef_array = [_]OptDef{
     .{ .short = "",  .long = "cache",              .value = .required, .optfn = opt_cache,              },
     .{ .short = "",  .long = "cache-stale",        .value = .required, .optfn = opt_cache_stale,        },
     .{ .short = "",  .long = "cache-refresh",      .value = .required, .optfn = opt_cache_refresh,      },
+    .{ .short = "",  .long = "cache-prefetch",     .value = .required, .optfn = opt_cache_prefetch,     },
     .{ .short = "",  .long = "cache-nodata-ttl",   .value = .required, .optfn = opt_cache_nodata_ttl,   },
     .{ .short = "",  .long = "cache-min-ttl",      .value = .required, .optfn = opt_cache_min_ttl,      },
     .{ .short = "",  .long = "cache-max-ttl",      .value = .required, .optfn = opt_cache_max_ttl,      },
@@ -149,11 +165,24 @@ const optdef_array = [_]OptDef{
     .{ .short = "",  .long = "cert-verify",        .value = .no_value, .optfn = opt_cert_verify,        },
     .{ .short = "",  .long = "ca-certs",           .value = .required, .optfn = opt_ca_certs,           },
     .{ .short = "",  .long = "no-ipset-blacklist", .value = .no_value, .optfn = opt_no_ipset_blacklist, },
+    .{ .short = "",  .long = "client-qps",         .value = .required, .optfn = opt_client_qps,         },
+    .{ .short = "",  .long = "max-pending",        .value = .required, .optfn = opt_max_pending,        },
+    .{ .short = "",  .long = "edns-bufsize",       .value = .required, .optfn = opt_edns_bufsize,       },
     .{ .short = "o", .long = "timeout-sec",        .value = .required, .optfn = opt_timeout_sec,        },
     .{ .short = "p", .long = "repeat-times",       .value = .required, .optfn = opt_repeat_times,       },
+    .{ .short = "",  .long = "upstream-best",      .value = .no_value, .optfn = opt_upstream_best,      },
+    .{ .short = "",  .long = "upstream-hedge",     .value = .no_value, .optfn = opt_upstream_hedge,     },
+    .{ .short = "",  .long = "upstream-warm",      .value = .no_value, .optfn = opt_upstream_warm,      },
+    .{ .short = "",  .long = "edns-keepalive",     .value = .no_value, .optfn = opt_edns_keepalive,     },
+    .{ .short = "",  .long = "fallback",           .value = .required, .optfn = opt_fallback,           },
+    .{ .short = "",  .long = "tcp-fastopen",       .value = .no_value, .optfn = opt_tcp_fastopen,       },
+    .{ .short = "",  .long = "ktls",               .value = .no_value, .optfn = opt_ktls,               },
     .{ .short = "n", .long = "noip-as-chnip",      .value = .no_value, .optfn = opt_noip_as_chnip,      },
     .{ .short = "f", .long = "fair-mode",          .value = .no_value, .optfn = opt_fair_mode,          },
     .{ .short = "r", .long = "reuse-port",         .value = .no_value, .optfn = opt_reuse_port,         },
+    .{ .short = "",  .long = "workers",            .value = .required, .optfn = opt_workers,            },
+    .{ .short = "",  .long = "worker-cpu-pin",     .value = .no_value, .optfn = opt_worker_cpu_pin,     },
+    .{ .short = "",  .long = "worker-qname-hash",  .value = .no_value, .optfn = opt_worker_qname_hash,  },
     .{ .short = "v", .long = "verbose",            .value = .no_value, .optfn = opt_verbose,            },
     .{ .short = "V", .long = "version",            .value = .no_value, .optfn = opt_version,            },
     .{ .short = "h", .long = "help",               .value = .no_value, .optfn = opt_help,               },
@@ -464,6 +493,12 @@ fn opt_cache_refresh(in_value: ?[]const u8) void {
         invalid_optvalue(@src(), value);
 }
 
+fn opt_cache_prefetch(in_value: ?[]const u8) void {
+    const value = in_value.?;
+    g.cache_prefetch = str2int.parse(@TypeOf(g.cache_prefetch), value, 10) orelse
+        invalid_optvalue(@src(), value);
+}
+
 fn opt_cache_nodata_ttl(in_value: ?[]const u8) void {
     const value = in_value.?;
     g.cache_nodata_ttl = str2int.parse(@TypeOf(g.cache_nodata_ttl), value, 10) orelse
@@ -543,6 +578,24 @@ fn opt_no_ipset_blacklist(_: ?[]const u8) void {
     c.ipset_blacklist = false;
 }
 
+fn opt_client_qps(in_value: ?[]const u8) void {
+    const value = in_value.?;
+    g.client_qps = str2int.parse(@TypeOf(g.client_qps), value, 10) orelse
+        invalid_optvalue(@src(), value);
+}
+
+fn opt_max_pending(in_value: ?[]const u8) void {
+    const value = in_value.?;
+    g.max_pending = str2int.parse(@TypeOf(g.max_pending), value, 10) orelse
+        invalid_optvalue(@src(), value);
+}
+
+fn opt_edns_bufsize(in_value: ?[]const u8) void {
+    const value = in_value.?;
+    g.edns_bufsz = str2int.parse(@TypeOf(g.edns_bufsz), value, 10) orelse 0;
+    if (g.edns_bufsz < c.DNS_EDNS_MINSIZE or g.edns_bufsz > c.DNS_EDNS_MAXSIZE) invalid_optvalue(@src(), value);
+}
+
 fn opt_timeout_sec(in_value: ?[]const u8) void {
     const value = in_value.?;
     g.upstream_timeout = str2int.parse(@TypeOf(g.upstream_timeout), value, 10) orelse 0;
@@ -556,6 +609,35 @@ fn opt_repeat_times(in_value: ?[]const u8) void {
     g.trustdns_packet_n = std.math.min(g.trustdns_packet_n, g.TRUSTDNS_PACKET_MAX);
 }
 
+fn opt_upstream_best(_: ?[]const u8) void {
+    g.flags.upstream_best = true;
+}
+
+fn opt_upstream_hedge(_: ?[]const u8) void {
+    g.flags.upstream_hedge = true;
+}
+
+fn opt_upstream_warm(_: ?[]const u8) void {
+    g.flags.upstream_warm = true;
+}
+
+fn opt_edns_keepalive(_: ?[]const u8) void {
+    g.flags.edns_keepalive = true;
+}
+
+fn opt_fallback(in_value: ?[]const u8) void {
+    const value = in_value.?;
+    groups.set_fallback(value) orelse invalid_optvalue(@src(), value);
+}
+
+fn opt_tcp_fastopen(_: ?[]const u8) void {
+    g.flags.tcp_fastopen = true;
+}
+
+fn opt_ktls(_: ?[]const u8) void {
+    g.flags.ktls = true;
+}
+
 fn opt_noip_as_chnip(_: ?[]const u8) void {
     g.flags.noip_as_chnip = true;
 }
@@ -568,6 +650,20 @@ fn opt_reuse_port(_: ?[]const u8) void {
     g.flags.reuse_port = true;
 }
 
+fn opt_workers(in_value: ?[]const u8) void {
+    const value = in_value.?;
+    g.worker_n = str2int.parse(@TypeOf(g.worker_n), value, 10) orelse invalid_optvalue(@src(), value);
+    if (g.worker_n > worker.MAX) invalid_optvalue(@src(), value);
+}
+
+fn opt_worker_cpu_pin(_: ?[]const u8) void {
+    g.flags.worker_cpu_pin = true;
+}
+
+fn opt_worker_qname_hash(_: ?[]const u8) void {
+    g.flags.worker_qname_hash = true;
+}
+
 fn opt_verbose(_: ?[]const u8) void {
     g.flags.verbose = true;
 }
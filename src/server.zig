@@ -13,9 +13,14 @@ const groups = @import("groups.zig");
 const Upstream = @import("Upstream.zig");
 const EvLoop = @import("EvLoop.zig");
 const RcMsg = @import("RcMsg.zig");
+const RecvBuf = @import("RecvBuf.zig");
 const Node = @import("Node.zig");
+const QidMap = @import("QidMap.zig");
+const CacheMsg = @import("CacheMsg.zig");
 const verdict_cache = @import("verdict_cache.zig");
 const local_rr = @import("local_rr.zig");
+const stats = @import("stats.zig");
+const admission = @import("admission.zig");
 const assert = std.debug.assert;
 
 comptime {
@@ -32,18 +37,28 @@ const Query = struct {
     fdobj: *EvLoop.Fd, // requester's fdobj
     trust_msg: ?*RcMsg = null,
     req_time: u64, // monotonic time (ms)
+    question: ?[]u8 = null, // indexed by List.qmap (singleflight)
+    waiters: ?*Waiter = null, // the same question from other requesters
+    hedge_upstream: ?*const Upstream = null, // the backup upstream of the hedged request
+    hedge_time: u64 = 0, // the hedged request is sent (ms)
+    fallback_time: u64 = 0, // [fallback] the query is sent to the fallback group (ms)
+    qmsg: ?*RcMsg = null, // [fallback] the query msg to be re-dispatched
 
     // alignment: 4
     src_addr: cc.SockAddr,
+    key: Key, // slot in the query_list
 
     // alignment: 2
-    qid: u16,
     id: c.be16, // original id
     bufsz: u16, // requester's receive bufsz
+    waiter_n: u16 = 0, // length of `waiters`
 
     // alignment: 1
     tag: Tag,
     flags: Flags,
+    udpi: bool = false, // the query is sent over udp (the reply may be truncated)
+    fell_back: bool = false, // [fallback] done (at most once)
+    prefetch: bool = false, // [prefetch] the query refreshes a popular cache entry
 
     pub const Flags = packed struct {
         from: enum(u2) { udp, tcp, local }, // from.local: {fdobj, src_addr} = undefined
@@ -63,11 +78,13 @@ const Query = struct {
         }
     };
 
-    fn new(qid: u16, id: c.be16, bufsz: u16, fdobj: *EvLoop.Fd, src_addr: *const cc.SockAddr, tag: Tag, flags: Flags) *Query {
+    pub const Key = QidMap.QueryKey;
+
+    fn new(key: Key, id: c.be16, bufsz: u16, fdobj: *EvLoop.Fd, src_addr: *const cc.SockAddr, tag: Tag, flags: Flags) *Query {
         const self = g.allocator.create(Query) catch unreachable;
 
         self.* = .{
-            .qid = qid,
+            .key = key,
             .id = id,
             .bufsz = bufsz,
             .fdobj = if (flags.from_client()) fdobj.ref() else undefined,
@@ -89,9 +106,93 @@ const Query = struct {
             msg.unref();
         }
 
+        if (self.qmsg) |qmsg|
+            qmsg.unref();
+
+        if (self.question) |question|
+            g.allocator.free(question);
+
+        var next = self.waiters;
+        while (next) |w| {
+            next = w.next;
+            w.free();
+        }
+
         g.allocator.destroy(self);
     }
 
+    /// requester attached to an in-flight query (singleflight)
+    pub const Waiter = struct {
+        next: ?*Waiter,
+        fdobj: *EvLoop.Fd, // requester's fdobj
+        src_addr: cc.SockAddr,
+        id: c.be16, // original id
+        bufsz: u16, // requester's receive bufsz
+        flags: Flags,
+
+        fn free(self: *const Waiter) void {
+            self.fdobj.unref();
+            g.allocator.destroy(self);
+        }
+    };
+
+    /// max number of requesters attached to a query (shed with REFUSED)
+    const WAITERS_MAX = 64;
+
+    /// the reply of `self` will also be sent to this requester
+    fn add_waiter(self: *Query, id: c.be16, bufsz: u16, fdobj: *EvLoop.Fd, src_addr: *const cc.SockAddr, flags: Flags) void {
+        assert(flags.from_client());
+
+        const w = g.allocator.create(Waiter) catch unreachable;
+
+        w.* = .{
+            .next = self.waiters,
+            .fdobj = fdobj.ref(),
+            .src_addr = src_addr.*,
+            .id = id,
+            .bufsz = bufsz,
+            .flags = flags,
+        };
+
+        self.waiters = w;
+        self.waiter_n += 1;
+    }
+
+    /// [fallback] the upstream is of the query's own group, not the fallback group
+    fn is_own_upstream(self: *const Query, upstream: *const Upstream) bool {
+        return if (self.tag == .none)
+            upstream.tag == .chn or upstream.tag == .gfw
+        else
+            upstream.tag == self.tag;
+    }
+
+    /// the query is sent to the upstream (the rtt sample starts from it)
+    fn send_time(self: *const Query, upstream: *const Upstream) u64 {
+        if (self.hedge_upstream == upstream)
+            return self.hedge_time;
+        if (self.fell_back and !self.is_own_upstream(upstream))
+            return self.fallback_time;
+        return self.req_time;
+    }
+
+    /// [fallback] reply to the requesters now, the query goes on as a refresh (from.local)
+    fn reply_early(self: *Query, msg: []const u8) void {
+        assert(self.flags.from_client());
+
+        send_reply(msg, self.fdobj, &self.src_addr, self.bufsz, self.id, self.flags);
+
+        var next = self.waiters;
+        while (next) |w| {
+            next = w.next;
+            send_reply(msg, w.fdobj, &w.src_addr, w.bufsz, w.id, w.flags);
+            w.free();
+        }
+        self.waiters = null;
+
+        self.fdobj.unref();
+        self.flags.from = .local;
+    }
+
     pub fn from_node(node: *Node) *Query {
         return @fieldParentPtr(Query, "node", node);
     }
@@ -118,88 +219,120 @@ const Query = struct {
 
             log.warn(
                 @src(),
-                "query(qid:%u, id:%u, tag:%s) from %s://%s#%u [timeout]",
-                .{ cc.to_uint(self.qid), cc.to_uint(self.id), self.tag.name(), from, &ip, cc.to_uint(port) },
+                "query(idx:%u, id:%u, tag:%s) from %s://%s#%u [timeout]",
+                .{ cc.to_uint(self.key.idx), cc.to_uint(self.id), self.tag.name(), from, &ip, cc.to_uint(port) },
             );
         }
 
         _query_list.del(self);
     }
 
+    /// pending queries: flat slot array, indexed by `Key.idx`. \
+    /// the upstream sessions map their own qids to the `Key`.
     pub const List = struct {
-        map: std.AutoHashMapUnmanaged(u16, *Query),
+        slots: std.ArrayListUnmanaged(Slot),
+        free_idx: ?u32 = null, // head of the free slots
+        n_pending: usize = 0,
+        qmap: std.AutoHashMapUnmanaged(c_uint, *Query), // hash(question) => query
         list: Node,
-        last_qid: u16 = 0,
+
+        const Slot = struct {
+            q: ?*Query = null,
+            gen: u32 = 0, // bumped when the slot is freed
+            next_free: ?u32 = null,
+        };
 
         pub fn init(self: *List) void {
             self.* = .{
-                .map = .{},
+                .slots = .{},
+                .qmap = .{},
                 .list = undefined,
             };
             self.list.init();
         }
 
         pub fn count(self: *const List) usize {
-            return self.map.count();
+            return self.n_pending;
         }
 
-        /// [on_query] msg.id => qid
+        /// [on_query] save the original msg.id
         pub fn add(
             self: *List,
-            msg: []u8,
+            msg: []const u8,
             fdobj: *EvLoop.Fd,
             src_addr: *const cc.SockAddr,
             bufsz: u16,
             tag: Tag,
             flags: Flags,
-        ) ?*Query {
-            const src = @src();
-
-            if (self.count() >= std.math.maxInt(u16) + 1) {
-                log.warn(src, "too many pending queries: %zu", .{self.count()});
-                return null;
-            }
-
-            var i: u32 = 0;
-            const qid = while (i < 10) : (i += 1) {
-                self.last_qid +%= 1;
-                const qid = self.last_qid;
-                if (!self.map.contains(qid))
-                    break qid;
-            } else {
-                log.warn(src, "no available qid. pending queries: %zu", .{self.count()});
-                return null;
+        ) *Query {
+            const idx = if (self.free_idx) |free| b: {
+                self.free_idx = self.slots.items[free].next_free;
+                break :b free;
+            } else b: {
+                self.slots.append(g.allocator, .{}) catch unreachable;
+                break :b cc.to_u32(self.slots.items.len - 1);
             };
 
-            const id = dns.get_id(msg);
-            dns.set_id(msg, qid);
+            const slot = &self.slots.items[idx];
+            const key: Key = .{ .idx = idx, .gen = slot.gen };
 
-            const q = Query.new(qid, id, bufsz, fdobj, src_addr, tag, flags);
+            const q = Query.new(key, dns.get_id(msg), bufsz, fdobj, src_addr, tag, flags);
 
-            self.map.putNoClobber(g.allocator, qid, q) catch unreachable;
+            slot.q = q;
+            self.n_pending += 1;
             self.list.link_to_tail(&q.node);
 
             return q;
         }
 
-        /// [on_reply] msg.id => original_id
-        pub fn get(self: *const List, msg: []u8) ?*Query {
-            const qid = dns.get_id(msg);
-            const q = self.map.get(qid) orelse return null;
-            dns.set_id(msg, q.id);
-            return q;
+        /// the question section (qname + qtype + qclass), case-sensitive (DNS 0x20)
+        fn question(msg: []const u8, qnamelen: c_int) []const u8 {
+            return msg[dns.header_len() .. dns.header_len() + dns.question_len(qnamelen)];
+        }
+
+        /// [on_query] in-flight query with the same question and tag
+        pub fn find(self: *const List, msg: []const u8, qnamelen: c_int, tag: Tag) ?*Query {
+            const qs = question(msg, qnamelen);
+            const q = self.qmap.get(cc.calc_hashv(qs)) orelse return null;
+            return if (q.tag == tag and cc.memeql(q.question.?, qs)) q else null;
+        }
+
+        /// [on_query] make the query findable (hash collision: keep the existing one)
+        pub fn index(self: *List, q: *Query, msg: []const u8, qnamelen: c_int) void {
+            const qs = question(msg, qnamelen);
+            const res = self.qmap.getOrPut(g.allocator, cc.calc_hashv(qs)) catch unreachable;
+            if (res.found_existing) return;
+            res.value_ptr.* = q;
+            q.question = g.allocator.dupe(u8, qs) catch unreachable;
+        }
+
+        /// [on_reply] null if the query has been completed (or timed out)
+        pub fn get(self: *const List, key: Key) ?*Query {
+            if (key.idx >= self.slots.items.len) return null;
+            const slot = &self.slots.items[key.idx];
+            return if (slot.gen == key.gen) slot.q else null;
         }
 
         /// remove from list and free(q)
         pub fn del(self: *List, q: *Query) void {
-            assert(self.map.remove(q.qid));
+            const slot = &self.slots.items[q.key.idx];
+            assert(slot.q == q);
+            slot.q = null;
+            slot.gen +%= 1;
+            slot.next_free = self.free_idx;
+            self.free_idx = q.key.idx;
+            self.n_pending -= 1;
+            if (q.question) |qs| {
+                assert(self.qmap.remove(cc.calc_hashv(qs)));
+                if (q.prefetch) cache.end_prefetch(qs);
+            }
             q.node.unlink();
             q.free();
         }
     };
 };
 
-/// qid => *query(q)
+/// key => *query(q)
 var _query_list: Query.List = undefined;
 
 // =======================================================================================================
@@ -243,38 +376,57 @@ fn tcp_server(fd: c_int, p_src_addr: *const cc.SockAddr) void {
         var free_qmsg: ?*RcMsg = null;
         defer if (free_qmsg) |qmsg| qmsg.free();
 
+        // pipelined queries are received with a single read
+        var rbuf: RecvBuf = .{};
+        defer rbuf.deinit();
+
         while (true) {
-            // read len (be16)
-            var len: u16 = undefined;
-            g.evloop.read(fdobj, std.mem.asBytes(&len)) catch |err| switch (err) {
-                error.eof => return,
-                error.errno => break :e .{ .op = "read_len" },
-            };
+            var msg_n: usize = 0;
+
+            while (rbuf.next()) |msg| : (msg_n += 1) {
+                if (msg.len < 1 or msg.len > c.DNS_QMSG_MAXSIZE) {
+                    log.warn(src, "invalid message length: %zu", .{msg.len});
+                    break :e .{ .op = "read_msg", .msg = "invalid len" };
+                }
 
-            len = cc.ntohs(len);
-            if (len < 1 or len > c.DNS_QMSG_MAXSIZE) {
-                log.warn(src, "invalid message length: %u", .{cc.to_uint(len)});
-                break :e .{ .op = "read_len", .msg = "invalid len" };
+                const qmsg = free_qmsg orelse RcMsg.new(c.DNS_QMSG_MAXSIZE);
+                free_qmsg = null;
+
+                defer {
+                    if (qmsg.is_unique())
+                        free_qmsg = qmsg
+                    else
+                        qmsg.unref();
+                }
+
+                qmsg.len = cc.to_u16(msg.len);
+                @memcpy(qmsg.msg().ptr, msg.ptr, msg.len);
+
+                nosuspend on_query(qmsg, fdobj, &src_addr, .{ .from = .tcp });
             }
 
-            const qmsg = free_qmsg orelse RcMsg.new(c.DNS_QMSG_MAXSIZE);
-            free_qmsg = null;
+            if (msg_n > 0)
+                stats.tcp_read_msgs.add(msg_n);
 
-            defer {
-                if (qmsg.is_unique())
-                    free_qmsg = qmsg
-                else
-                    qmsg.unref();
+            // check the len of the incomplete msg
+            if (rbuf.pending_len()) |len| {
+                if (len < 1 or len > c.DNS_QMSG_MAXSIZE) {
+                    log.warn(src, "invalid message length: %u", .{cc.to_uint(len)});
+                    break :e .{ .op = "read_len", .msg = "invalid len" };
+                }
             }
 
-            // read msg
-            qmsg.len = len;
-            g.evloop.read(fdobj, qmsg.msg()) catch |err| switch (err) {
-                error.eof => break :e .{ .op = "read_msg", .msg = "connection closed" },
+            // backpressure: the client is not reading the replies
+            TcpConn.wait_drained(fdobj);
+
+            const n = g.evloop.read_some(fdobj, rbuf.space()) catch |err| switch (err) {
+                error.eof => {
+                    if (rbuf.is_empty()) return;
+                    break :e .{ .op = "read_msg", .msg = "connection closed" };
+                },
                 error.errno => break :e .{ .op = "read_msg" },
             };
-
-            nosuspend on_query(qmsg, fdobj, &src_addr, .{ .from = .tcp });
+            rbuf.commit(n);
         }
     };
 
@@ -294,28 +446,52 @@ fn udp_server(fd: c_int, ip: cc.ConstStr, port: u16) void {
     const fdobj = EvLoop.Fd.new(fd);
     defer fdobj.free();
 
-    var free_qmsg: ?*RcMsg = null;
-    defer if (free_qmsg) |qmsg| qmsg.free();
+    const reply_batch = UdpReplyBatch.new(fdobj);
+    defer reply_batch.free();
 
-    while (true) {
-        const qmsg = free_qmsg orelse RcMsg.new(c.DNS_QMSG_MAXSIZE);
-        free_qmsg = null;
+    var qmsgs: [UDP_BATCH_MAX]*RcMsg = undefined;
+    for (qmsgs) |*qmsg|
+        qmsg.* = RcMsg.new(c.DNS_QMSG_MAXSIZE);
+    defer for (qmsgs) |qmsg| qmsg.unref();
 
-        defer {
-            if (qmsg.is_unique())
-                free_qmsg = qmsg
-            else
-                qmsg.unref();
+    var src_addrs: [UDP_BATCH_MAX]cc.SockAddr = undefined;
+    var iovs: [UDP_BATCH_MAX]cc.iovec_t = undefined;
+    var msgv: [UDP_BATCH_MAX]cc.mmsghdr_t = undefined;
+
+    while (true) {
+        for (msgv) |*m, i| {
+            iovs[i] = .{
+                .iov_base = qmsgs[i].buf().ptr,
+                .iov_len = qmsgs[i].cap,
+            };
+            m.* = .{
+                .msg_hdr = .{
+                    .msg_name = &src_addrs[i],
+                    .msg_namelen = @sizeOf(cc.SockAddr),
+                    .msg_iov = iovs[i..].ptr,
+                    .msg_iovlen = 1,
+                },
+            };
         }
 
-        var src_addr: cc.SockAddr = undefined;
-        const len = g.evloop.read_udp(fdobj, qmsg.buf(), &src_addr) orelse {
-            log.warn(@src(), "recvfrom(fd:%d, %s#%u) failed: (%d) %m", .{ fd, ip, cc.to_uint(port), cc.errno() });
+        const msgs = g.evloop.read_udp_batch(fdobj, &msgv) orelse {
+            log.warn(@src(), "recvmmsg(fd:%d, %s#%u) failed: (%d) %m", .{ fd, ip, cc.to_uint(port), cc.errno() });
             continue;
         };
-        qmsg.len = cc.to_u16(len);
+        stats.udp_recv_batch.add(msgs.len);
 
-        nosuspend on_query(qmsg, fdobj, &src_addr, .{ .from = .udp });
+        for (msgs) |*m, i| {
+            const qmsg = qmsgs[i];
+            qmsg.len = cc.to_u16(m.msg_len);
+
+            nosuspend on_query(qmsg, fdobj, &src_addrs[i], .{ .from = .udp });
+
+            // still referenced by the upstream session
+            if (!qmsg.is_unique()) {
+                qmsg.unref();
+                qmsgs[i] = RcMsg.new(c.DNS_QMSG_MAXSIZE);
+            }
+        }
     }
 }
 
@@ -364,6 +540,14 @@ const QueryLog = struct {
         );
     }
 
+    pub noinline fn shed(self: *const QueryLog, reason: admission.Reason) void {
+        log.info(
+            @src(),
+            "query(id:%u, tag:%s, qtype:%u, '%s') shed by admission control: %s",
+            .{ cc.to_uint(self.id), self.tag.name(), cc.to_uint(self.qtype), self.name, @tagName(reason).ptr },
+        );
+    }
+
     pub noinline fn local_rr(self: *const QueryLog, answer_n: u16, answer_sz: usize) void {
         log.info(
             @src(),
@@ -388,6 +572,14 @@ const QueryLog = struct {
         );
     }
 
+    pub noinline fn prefetch(self: *const QueryLog, ttl: i32) void {
+        log.info(
+            @src(),
+            "prefetch cache(tag:%s, qtype:%u, '%s') ttl:%ld",
+            .{ self.tag.name(), cc.to_uint(self.qtype), self.name, cc.to_long(ttl) },
+        );
+    }
+
     pub noinline fn add_ip(self: *const QueryLog, setnames: cc.ConstStr) void {
         log.info(
             @src(),
@@ -407,8 +599,8 @@ const QueryLog = struct {
 
         log.info(
             @src(),
-            "forward query(qid:%u, from:%s, '%s') to %s group",
-            .{ cc.to_uint(q.qid), from, self.name, to },
+            "forward query(idx:%u, from:%s, '%s') to %s group",
+            .{ cc.to_uint(q.key.idx), from, self.name, to },
         );
     }
 };
@@ -422,14 +614,36 @@ fn on_query(qmsg: *RcMsg, fdobj: *EvLoop.Fd, src_addr: *const cc.SockAddr, in_qf
     const p_ascii_namebuf: ?[*]u8 = if (g.verbose() or !dnl.is_empty()) &ascii_namebuf else null;
     var qnamelen: c_int = undefined;
 
-    if (!dns.check_query(msg, p_ascii_namebuf, &qnamelen)) {
-        var src_ip: cc.IpStrBuf = undefined;
-        var src_port: u16 = undefined;
-        src_addr.to_text(&src_ip, &src_port);
-        log.warn(@src(), "dns.check_query(%s#%u) failed: invalid query msg", .{ &src_ip, cc.to_uint(src_port) });
-        return send_reply_bad(msg, fdobj, src_addr, qflags); // make the requester happy
+    // ===================== fast lane (cache hit) =====================
+
+    // probe the cache with the wire-format question, before the ascii decoding and the dnl lookup.
+    // the entry remembers the tag decided when it was added (it has passed the qtype/local_rr/tag:null checks).
+    if (!g.verbose() and cache.enabled()) {
+        if (!dns.check_query(msg, null, &qnamelen))
+            return on_bad_query(msg, fdobj, src_addr, qflags);
+
+        var tag: Tag = undefined;
+        var ttl: i32 = undefined;
+        var ttl_r: i32 = undefined;
+        var add_ip: bool = undefined;
+        if (cache.get(msg, qnamelen, null, &tag, &ttl, &ttl_r, &add_ip)) |cache_msg| {
+            stats.queries += 1;
+            stats.cache_fast_hits += 1;
+            const bufsz = get_bufsz(msg, qnamelen, qflags);
+            var qlog: QueryLog = undefined;
+            return on_cache_hit(qmsg, qnamelen, cache_msg, ttl, ttl_r, add_ip, fdobj, src_addr, bufsz, tag, qflags, &qlog);
+        }
+
+        // cache miss, decode the name (if necessary)
+        if (p_ascii_namebuf != null)
+            assert(dns.check_query(msg, p_ascii_namebuf, &qnamelen));
+    } else {
+        if (!dns.check_query(msg, p_ascii_namebuf, &qnamelen))
+            return on_bad_query(msg, fdobj, src_addr, qflags);
     }
 
+    stats.queries += 1;
+
     const id = dns.get_id(msg);
     const tag = dnl.get_tag(&ascii_namebuf, dns.ascii_namelen(qnamelen));
     const qtype = dns.get_qtype(msg, qnamelen);
@@ -448,11 +662,7 @@ fn on_query(qmsg: *RcMsg, fdobj: *EvLoop.Fd, src_addr: *const cc.SockAddr, in_qf
         qlog.query();
     }
 
-    const bufsz = switch (qflags.from) {
-        .udp => dns.get_bufsz(msg, qnamelen),
-        .tcp => cc.to_u16(c.DNS_MSG_MAXSIZE),
-        .local => unreachable,
-    };
+    const bufsz = get_bufsz(msg, qnamelen, qflags);
 
     // ===================== qtype filter =====================
 
@@ -493,41 +703,151 @@ fn on_query(qmsg: *RcMsg, fdobj: *EvLoop.Fd, src_addr: *const cc.SockAddr, in_qf
         return send_reply(rmsg, fdobj, src_addr, bufsz, id, qflags);
     }
 
-    var udpi = qflags.from == .udp;
-
     // cache
     var ttl: i32 = undefined;
     var ttl_r: i32 = undefined;
     var add_ip: bool = undefined;
-    if (cache.get(msg, qnamelen, &ttl, &ttl_r, &add_ip)) |cache_msg| {
-        if (g.verbose()) qlog.cache(cache_msg, ttl);
-
-        // add the ip to the ipset/nftset
-        if (add_ip and tag != .none and (qtype == c.DNS_TYPE_A or qtype == c.DNS_TYPE_AAAA)) {
-            if (groups.get_ipset_addctx(tag)) |addctx| {
-                if (g.verbose()) qlog.add_ip(groups.get_ipset_name46(tag).cstr());
-                dns.add_ip(cache_msg, qnamelen, addctx);
-            }
-        }
+    var cache_tag: Tag = undefined;
+    if (cache.get(msg, qnamelen, tag, &cache_tag, &ttl, &ttl_r, &add_ip)) |cache_msg|
+        return on_cache_hit(qmsg, qnamelen, cache_msg, ttl, ttl_r, add_ip, fdobj, src_addr, bufsz, tag, qflags, &qlog);
 
-        // sync && nosuspend
-        send_reply(cache_msg, fdobj, src_addr, bufsz, id, qflags);
+    forward_query(qmsg, qnamelen, fdobj, src_addr, bufsz, tag, qflags, qflags.from == .udp, &qlog);
+}
 
-        if (ttl > ttl_r)
-            return;
+fn on_bad_query(msg: []u8, fdobj: *EvLoop.Fd, src_addr: *const cc.SockAddr, qflags: Query.Flags) void {
+    var src_ip: cc.IpStrBuf = undefined;
+    var src_port: u16 = undefined;
+    src_addr.to_text(&src_ip, &src_port);
+    log.warn(@src(), "dns.check_query(%s#%u) failed: invalid query msg", .{ &src_ip, cc.to_uint(src_port) });
+    return send_reply_bad(msg, fdobj, src_addr, qflags); // make the requester happy
+}
 
-        // refresh cache in the background
-        if (g.verbose())
-            qlog.refresh(ttl);
+/// requester's receive bufsz
+fn get_bufsz(msg: []const u8, qnamelen: c_int, qflags: Query.Flags) u16 {
+    return switch (qflags.from) {
+        .udp => dns.get_bufsz(msg, qnamelen),
+        .tcp => cc.to_u16(c.DNS_MSG_MAXSIZE),
+        .local => unreachable,
+    };
+}
 
-        // avoid receiving truncated response
-        if (udpi and cache_msg.len + 30 > c.DNS_EDNS_MINSIZE)
-            udpi = false; // change to tcpi://
+/// nosuspend
+fn on_cache_hit(
+    qmsg: *RcMsg,
+    qnamelen: c_int,
+    cache_msg: []const u8,
+    ttl: i32,
+    ttl_r: i32,
+    add_ip: bool,
+    fdobj: *EvLoop.Fd,
+    src_addr: *const cc.SockAddr,
+    bufsz: u16,
+    tag: Tag,
+    in_qflags: Query.Flags,
+    qlog: *const QueryLog,
+) void {
+    const msg = qmsg.msg();
+    const id = dns.get_id(msg);
+    const qtype = dns.get_qtype(msg, qnamelen);
+    var qflags = in_qflags;
 
-        // mark the query
-        qflags.from = .local;
+    if (g.verbose()) qlog.cache(cache_msg, ttl);
+
+    stats.cache_hits += 1;
+
+    // add the ip to the ipset/nftset
+    if (add_ip and tag != .none and (qtype == c.DNS_TYPE_A or qtype == c.DNS_TYPE_AAAA)) {
+        if (groups.get_ipset_addctx(tag)) |addctx| {
+            if (g.verbose()) qlog.add_ip(groups.get_ipset_name46(tag).cstr());
+            dns.add_ip(cache_msg, qnamelen, addctx);
+        }
     }
 
+    // sync && nosuspend
+    send_reply(cache_msg, fdobj, src_addr, bufsz, id, qflags);
+
+    if (ttl > ttl_r)
+        return;
+
+    // refresh cache in the background
+    if (g.verbose())
+        qlog.refresh(ttl);
+
+    // avoid receiving truncated response
+    var udpi = qflags.from == .udp;
+    if (udpi and cache_msg.len + 30 > upstream_bufsz())
+        udpi = false; // change to tcpi://
+
+    // mark the query
+    qflags.from = .local;
+
+    forward_query(qmsg, qnamelen, fdobj, src_addr, bufsz, tag, qflags, udpi, qlog);
+}
+
+/// [check_timeout] refresh the popular cache before it expires
+fn prefetch(cache_msg: *const CacheMsg) void {
+    const qmsg = RcMsg.new(c.DNS_QMSG_MAXSIZE);
+    defer qmsg.unref();
+
+    qmsg.len = cc.to_u16(dns.make_query(qmsg.buf(), cache_msg.msg(), cache_msg.qnamelen).len);
+    const msg = qmsg.msg();
+
+    var ascii_namebuf: [c.DNS_NAME_MAXLEN:0]u8 = undefined;
+    const p_ascii_namebuf: ?[*]u8 = if (g.verbose() or !dnl.is_empty()) &ascii_namebuf else null;
+    var qnamelen: c_int = undefined;
+
+    if (!dns.check_query(msg, p_ascii_namebuf, &qnamelen))
+        return cache.end_prefetch(cache_msg.question());
+
+    const tag = dnl.get_tag(&ascii_namebuf, dns.ascii_namelen(qnamelen));
+    const qtype = dns.get_qtype(msg, qnamelen);
+
+    const qlog: QueryLog = if (g.verbose()) .{
+        .src_ip = undefined,
+        .src_port = undefined,
+        .id = 0,
+        .qtype = qtype,
+        .tag = tag,
+        .name = &ascii_namebuf,
+    } else undefined;
+
+    if (g.verbose())
+        qlog.prefetch(cache_msg.get_ttl());
+
+    // avoid receiving truncated response
+    const udpi = cache_msg.msg_len + 30 <= upstream_bufsz();
+
+    forward_query(qmsg, qnamelen, undefined, undefined, 0, tag, .{ .from = .local }, udpi, &qlog);
+
+    // the entry is prefetched until the query (or the in-flight one) completes,
+    // see `List.del()`; not sent: can be queued again
+    if (_query_list.find(msg, qnamelen, tag)) |q|
+        q.prefetch = true
+    else
+        cache.end_prefetch(dns.question(msg, qnamelen));
+}
+
+/// udp payload size of the query sent to upstream
+fn upstream_bufsz() u16 {
+    return if (g.edns_bufsz > 0) g.edns_bufsz else c.DNS_EDNS_MINSIZE;
+}
+
+/// nosuspend
+fn forward_query(
+    qmsg: *RcMsg,
+    qnamelen: c_int,
+    fdobj: *EvLoop.Fd,
+    src_addr: *const cc.SockAddr,
+    bufsz: u16,
+    tag: Tag,
+    in_qflags: Query.Flags,
+    udpi: bool,
+    qlog: *const QueryLog,
+) void {
+    const msg = qmsg.msg();
+    const id = dns.get_id(msg);
+    var qflags = in_qflags;
+
     // verdict cache
     var tagnone_to_china = true;
     var tagnone_to_trust = true;
@@ -545,6 +865,42 @@ fn on_query(qmsg: *RcMsg, fdobj: *EvLoop.Fd, src_addr: *const cc.SockAddr, in_qf
 
     // ===================== forward to upstream =====================
 
+    // admission control: the client's rate limit also applies to the joining requester
+    if (qflags.from_client()) {
+        if (admission.check_client(src_addr)) |reason|
+            return shed_query(reason, msg, qnamelen, fdobj, src_addr, bufsz, qflags, qlog);
+    }
+
+    // singleflight: wait for the reply of the in-flight query
+    if (_query_list.find(msg, qnamelen, tag)) |inflight| {
+        // refresh: the in-flight query will update the cache
+        if (!qflags.from_client())
+            return;
+
+        // the reply over udp may be truncated: only accepted by the udp requester,
+        // and dropped if the in-flight query is not from a udp requester (e.g. refresh)
+        if (!inflight.udpi or (inflight.flags.from == .udp and qflags.from == .udp)) {
+            if (inflight.waiter_n >= Query.WAITERS_MAX)
+                return shed_query(.waiters, msg, qnamelen, fdobj, src_addr, bufsz, qflags, qlog);
+            inflight.add_waiter(id, bufsz, fdobj, src_addr, qflags);
+            stats.coalesced += 1;
+            return;
+        }
+    }
+
+    if (qflags.from_client()) {
+        if (admission.check_pending(_query_list.count())) |reason|
+            return shed_query(reason, msg, qnamelen, fdobj, src_addr, bufsz, qflags, qlog);
+    } else if (admission.overloaded()) {
+        return; // refresh/prefetch can wait
+    }
+
+    // advertise our udp bufsz to the upstream (the reply is truncated locally)
+    if (g.edns_bufsz > 0) {
+        const len = dns.set_bufsz(qmsg.buf(), qmsg.len, qnamelen, g.edns_bufsz);
+        if (len > 0) qmsg.len = len;
+    }
+
     const q = _query_list.add(
         msg,
         fdobj,
@@ -552,22 +908,57 @@ fn on_query(qmsg: *RcMsg, fdobj: *EvLoop.Fd, src_addr: *const cc.SockAddr, in_qf
         bufsz,
         tag,
         qflags,
-    ) orelse return;
+    );
+
+    _query_list.index(q, msg, qnamelen);
+
+    q.udpi = udpi;
+
+    const fallback = groups.get_fallback(tag);
+    if (fallback.enabled()) {
+        q.qmsg = qmsg.ref();
+        if (fallback.delay > 0)
+            Fallback.add(q.key, fallback.delay);
+    }
+
+    stats.forwarded += 1;
 
     if (tag == .none) {
         if (tagnone_to_china)
-            send_query(.chn, qmsg, udpi, q, &qlog);
+            send_query(.chn, qmsg, udpi, q, qlog);
         if (tagnone_to_trust)
-            send_query(.gfw, qmsg, udpi, q, &qlog);
+            send_query(.gfw, qmsg, udpi, q, qlog);
     } else {
-        send_query(tag, qmsg, udpi, q, &qlog);
+        send_query(tag, qmsg, udpi, q, qlog);
     }
 }
 
+/// [nosuspend] refused by the admission control
+fn shed_query(
+    reason: admission.Reason,
+    msg: []u8,
+    qnamelen: c_int,
+    fdobj: *EvLoop.Fd,
+    src_addr: *const cc.SockAddr,
+    bufsz: u16,
+    qflags: Query.Flags,
+    qlog: *const QueryLog,
+) void {
+    switch (reason) {
+        .rate_limit => stats.shed_rate_limit += 1,
+        .overload => stats.shed_overload += 1,
+        .waiters => stats.shed_waiters += 1,
+    }
+    if (g.verbose()) qlog.shed(reason);
+    const id = dns.get_id(msg);
+    const rmsg = dns.error_reply(msg, qnamelen, reason.rcode());
+    return send_reply(rmsg, fdobj, src_addr, bufsz, id, qflags);
+}
+
 /// nosuspend
 fn send_query(to_tag: Tag, qmsg: *RcMsg, udpi: bool, q: *const Query, qlog: *const QueryLog) void {
     if (g.verbose()) qlog.forward(q, to_tag);
-    nosuspend groups.get_upstream_group(to_tag).send(qmsg, udpi);
+    nosuspend groups.get_upstream_group(to_tag).send(qmsg, udpi, q.key);
 }
 
 // =========================================================================
@@ -581,7 +972,7 @@ comptime {
 const ReplyLog = struct {
     name: cc.ConstStr,
     url: cc.ConstStr,
-    qid: u16,
+    idx: u32, // query_list slot
     qtype: u16,
     tag: ?Tag,
 
@@ -594,24 +985,24 @@ const ReplyLog = struct {
         const url = alt_url orelse self.url;
         log.info(
             @src(),
-            "reply(qid:%u, tag:%s, qtype:%u, '%s') from %s [%s]",
-            .{ cc.to_uint(self.qid), self.tag_name(), cc.to_uint(self.qtype), self.name, url, action },
+            "reply(idx:%u, tag:%s, qtype:%u, '%s') from %s [%s]",
+            .{ cc.to_uint(self.idx), self.tag_name(), cc.to_uint(self.qtype), self.name, url, action },
         );
     }
 
     pub noinline fn add_ip(self: *const ReplyLog, setnames: cc.ConstStr) void {
         log.info(
             @src(),
-            "add answer_ip(qid:%u, tag:%s, qtype:%u, '%s') to %s",
-            .{ cc.to_uint(self.qid), self.tag_name(), cc.to_uint(self.qtype), self.name, setnames },
+            "add answer_ip(idx:%u, tag:%s, qtype:%u, '%s') to %s",
+            .{ cc.to_uint(self.idx), self.tag_name(), cc.to_uint(self.qtype), self.name, setnames },
         );
     }
 
     pub noinline fn noaaaa(self: *const ReplyLog, rule: cc.ConstStr) void {
         log.info(
             @src(),
-            "reply(qid:%u, tag:%s, qtype:AAAA, '%s') filtered by rule: %s",
-            .{ cc.to_uint(self.qid), self.tag_name(), self.name, rule },
+            "reply(idx:%u, tag:%s, qtype:AAAA, '%s') filtered by rule: %s",
+            .{ cc.to_uint(self.idx), self.tag_name(), self.name, rule },
         );
     }
 
@@ -619,16 +1010,16 @@ const ReplyLog = struct {
         const action = cc.b2s(g.flags.noip_as_chnip, "accept", "filter");
         log.info(
             @src(),
-            "reply(qid:%u, tag:%s, qtype:%u, '%s') has no answer ip [%s]",
-            .{ cc.to_uint(self.qid), self.tag_name(), cc.to_uint(self.qtype), self.name, action },
+            "reply(idx:%u, tag:%s, qtype:%u, '%s') has no answer ip [%s]",
+            .{ cc.to_uint(self.idx), self.tag_name(), cc.to_uint(self.qtype), self.name, action },
         );
     }
 
     pub noinline fn cache(self: *const ReplyLog, ttl: i32, sz: usize) void {
         log.info(
             @src(),
-            "add cache(qid:%u, tag:%s, qtype:%u, '%s') size:%zu ttl:%ld",
-            .{ cc.to_uint(self.qid), self.tag_name(), cc.to_uint(self.qtype), self.name, sz, cc.to_long(ttl) },
+            "add cache(idx:%u, tag:%s, qtype:%u, '%s') size:%zu ttl:%ld",
+            .{ cc.to_uint(self.idx), self.tag_name(), cc.to_uint(self.qtype), self.name, sz, cc.to_long(ttl) },
         );
     }
 };
@@ -653,8 +1044,10 @@ fn use_china_reply(msg: []const u8, qnamelen: c_int, p_test_res: *?dns.TestIpRes
     };
 }
 
-/// [nosuspend]
-pub fn on_reply(rmsg: *RcMsg, upstream: *const Upstream) void {
+/// [nosuspend] `qkey`: the query mapped from the msg.id by the upstream session
+/// `rtt_ok`: the reply is a valid rtt sample (the query didn't wait for the connect,
+/// and is not a retransmitted copy, see `Upstream.send()`)
+pub fn on_reply(rmsg: *RcMsg, upstream: *Upstream, qkey: Query.Key, rtt_ok: bool) void {
     var msg = rmsg.msg();
 
     var ascii_namebuf: [c.DNS_NAME_MAXLEN:0]u8 = undefined;
@@ -675,14 +1068,14 @@ pub fn on_reply(rmsg: *RcMsg, upstream: *const Upstream) void {
     const is_qtype_A_AAAA = qtype == c.DNS_TYPE_A or qtype == c.DNS_TYPE_AAAA;
 
     var rlog: ReplyLog = if (g.verbose()) .{
-        .qid = dns.get_id(msg),
+        .idx = qkey.idx,
         .tag = null,
         .qtype = qtype,
         .name = &ascii_namebuf,
         .url = upstream.url,
     } else undefined;
 
-    const q = _query_list.get(msg) orelse {
+    const q = _query_list.get(qkey) orelse {
         if (g.verbose())
             rlog.reply("ignore", null);
         return;
@@ -691,6 +1084,10 @@ pub fn on_reply(rmsg: *RcMsg, upstream: *const Upstream) void {
     if (g.verbose())
         rlog.tag = q.tag;
 
+    // each copy has its own qid, only the retransmitted one is ambiguous (Karn's algorithm)
+    if (rtt_ok)
+        upstream.on_rtt(g.evloop.time - q.send_time(upstream));
+
     // NOTE: udp resolver will auto retry with TCP
     if (q.flags.from != .udp and dns.is_tc(msg)) {
         if (g.verbose())
@@ -698,6 +1095,25 @@ pub fn on_reply(rmsg: *RcMsg, upstream: *const Upstream) void {
         return;
     }
 
+    // the fallback group is tried once, its reply is accepted as is.
+    // [tag:none] the SERVFAIL of chinadns is filtered by the ip test (waiting for trustdns).
+    const rcode = dns.get_rcode(msg);
+    if ((rcode == c.DNS_RCODE_SERVFAIL or rcode == c.DNS_RCODE_REFUSED) and
+        !(q.tag == .none and is_qtype_A_AAAA and upstream.tag == .chn))
+    {
+        if (fall_back(q, cc.b2s(rcode == c.DNS_RCODE_SERVFAIL, "servfail", "refused"))) {
+            if (g.verbose())
+                rlog.reply("fallback", null);
+            return;
+        }
+        // fell back already: wait for the fallback group (or the timeout)
+        if (q.fell_back and q.is_own_upstream(upstream)) {
+            if (g.verbose())
+                rlog.reply("ignore", null);
+            return;
+        }
+    }
+
     var ip_test_res: ?dns.TestIpResult = null;
 
     // end the query context ?
@@ -739,7 +1155,11 @@ pub fn on_reply(rmsg: *RcMsg, upstream: *const Upstream) void {
                     return;
                 }
             },
-            else => unreachable,
+            else => {
+                // the fallback group
+                if (g.verbose())
+                    rlog.reply("accept", null);
+            },
         }
     } else {
         if (g.verbose())
@@ -766,17 +1186,139 @@ pub fn on_reply(rmsg: *RcMsg, upstream: *const Upstream) void {
 
     // add to cache (may modify the msg.ttl)
     var ttl: i32 = undefined;
-    if (cache.add(msg, qnamelen, &ttl))
+    if (cache.add(msg, qnamelen, q.tag, &ttl))
         if (g.verbose()) rlog.cache(ttl, msg.len);
 
+    // the backup upstream replied first
+    if (q.hedge_upstream == upstream)
+        stats.hedge_wins += 1;
+
     // [sync && nosuspend] send reply to client
     if (q.flags.from_client())
         send_reply(msg, q.fdobj, &q.src_addr, q.bufsz, q.id, q.flags);
 
+    // the requesters of the same question (singleflight)
+    var next = q.waiters;
+    while (next) |w| : (next = w.next)
+        send_reply(msg, w.fdobj, &w.src_addr, w.bufsz, w.id, w.flags);
+
     // must be at the end
     _query_list.del(q);
 }
 
+/// the query still waits for the reply of the group of `upstream`
+fn is_waiting(q: *const Query, upstream: *const Upstream) bool {
+    return switch (upstream.tag) {
+        .chn => q.flags.verdict != .non_china, // [tag:none] the china reply has been filtered
+        .gfw => q.trust_msg == null, // [tag:none] the trust reply is waiting for the verdict
+        else => true,
+    };
+}
+
+/// [check_timeout] the hedge timer of `upstream` (backup) expires. \
+/// return false if the query no longer waits for the reply of this group.
+pub fn on_hedge(qkey: Query.Key, upstream: *const Upstream) bool {
+    const q = _query_list.get(qkey) orelse return false;
+
+    if (!is_waiting(q, upstream))
+        return false;
+
+    q.hedge_upstream = upstream;
+    q.hedge_time = g.evloop.time;
+    return true;
+}
+
+/// [check_timeout] the retransmission timer of `upstream` (udp) expires. \
+/// return false if the query no longer waits for the reply of this group.
+pub fn on_retransmit(qkey: Query.Key, upstream: *const Upstream) bool {
+    const q = _query_list.get(qkey) orelse return false;
+
+    return is_waiting(q, upstream);
+}
+
+/// [nosuspend] the upstreams of the query's group don't reply in time, or reply SERVFAIL/REFUSED: \
+/// answer from the expired cache and/or re-dispatch to the fallback group. \
+/// return false if there is nothing to fall back on.
+fn fall_back(q: *Query, reason: cc.ConstStr) bool {
+    const qmsg = q.qmsg orelse return false;
+    if (q.fell_back)
+        return false;
+
+    const fallback = groups.get_fallback(q.tag);
+    var stale = false;
+
+    // the reply of the upstream will update the cache
+    if (fallback.stale and q.flags.from_client()) {
+        const msg = qmsg.msg();
+        var qnamelen: c_int = undefined;
+        if (dns.check_query(msg, null, &qnamelen)) {
+            if (cache.get_stale(msg, qnamelen)) |cache_msg| {
+                stats.fallback_stale += 1;
+                q.reply_early(cache_msg);
+                stale = true;
+            }
+        }
+    }
+
+    if (fallback.tag) |tag| {
+        stats.fallbacks += 1;
+        q.fallback_time = g.evloop.time;
+        nosuspend groups.get_upstream_group(tag).send(qmsg, q.udpi, q.key);
+    }
+
+    if (!stale and fallback.tag == null)
+        return false;
+
+    q.fell_back = true;
+
+    if (g.verbose())
+        log.info(
+            @src(),
+            "query(idx:%u, tag:%s) [%s] fallback to tag:%s stale:%s",
+            .{
+                cc.to_uint(q.key.idx),
+                q.tag.name(),
+                reason,
+                if (fallback.tag) |tag| tag.name() else "-",
+                cc.b2s(stale, "yes", "no"),
+            },
+        );
+
+    return true;
+}
+
+/// [`--fallback`] the delay of the query's group expires
+const Fallback = struct {
+    node: Node = undefined, // _fallback_list node
+    deadline: u64,
+    qkey: Query.Key,
+
+    fn from_node(node: *Node) *Fallback {
+        return @fieldParentPtr(Fallback, "node", node);
+    }
+
+    fn add(qkey: Query.Key, delay: u64) void {
+        const self = g.allocator.create(Fallback) catch unreachable;
+        self.* = .{
+            .deadline = g.evloop.time + delay,
+            .qkey = qkey,
+        };
+        _fallback_list.link_by_deadline(Fallback, self);
+    }
+
+    /// [nosuspend] remove from the list, fall back if the query is still pending
+    fn fire(self: *Fallback) void {
+        self.node.unlink();
+        defer g.allocator.destroy(self);
+
+        if (_query_list.get(self.qkey)) |q|
+            _ = fall_back(q, "timeout");
+    }
+};
+
+/// ordered by deadline
+var _fallback_list: Node = undefined;
+
 // =========================================================================
 
 /// [sync && nosuspend]
@@ -802,20 +1344,14 @@ fn send_reply(msg: []const u8, fdobj: *EvLoop.Fd, src_addr: *const cc.SockAddr,
                     .iov_len = tc_msg[2..].len,
                 };
             }
-            const msghdr = cc.msghdr_t{
-                .msg_name = cc.remove_const(src_addr),
-                .msg_namelen = src_addr.len(),
-                .msg_iov = iovec[1..],
-                .msg_iovlen = iovec[1..].len,
-            };
-            _ = cc.sendmsg(fdobj.fd, &msghdr, 0);
+            UdpReplyBatch.get(fdobj).push(src_addr, iovec[1..]);
         },
         .tcp => {
             iovec[0] = .{
                 .iov_base = std.mem.asBytes(&cc.htons(cc.to_u16(msg.len))),
                 .iov_len = 2,
             };
-            _tcp_sender.send(fdobj, &iovec);
+            TcpConn.push(fdobj, &iovec);
         },
         .local => unreachable,
     }
@@ -828,7 +1364,13 @@ fn send_reply_bad(msg: []u8, fdobj: *EvLoop.Fd, src_addr: *const cc.SockAddr, qf
 
     switch (qflags.from) {
         .udp => {
-            _ = cc.sendto(fdobj.fd, msg, 0, src_addr);
+            var iovec = [_]cc.iovec_t{
+                .{
+                    .iov_base = msg.ptr,
+                    .iov_len = msg.len,
+                },
+            };
+            UdpReplyBatch.get(fdobj).push(src_addr, &iovec);
         },
         .tcp => {
             var iovec = [_]cc.iovec_t{
@@ -841,7 +1383,7 @@ fn send_reply_bad(msg: []u8, fdobj: *EvLoop.Fd, src_addr: *const cc.SockAddr, qf
                     .iov_len = msg.len,
                 },
             };
-            _tcp_sender.send(fdobj, &iovec);
+            TcpConn.push(fdobj, &iovec);
         },
         .local => unreachable,
     }
@@ -849,183 +1391,335 @@ fn send_reply_bad(msg: []u8, fdobj: *EvLoop.Fd, src_addr: *const cc.SockAddr, qf
 
 // =========================================================================
 
-var _tcp_sender: TcpSender = undefined;
+/// max number of datagrams per recvmmsg/sendmmsg (udp listener)
+const UDP_BATCH_MAX = 16;
+
+/// udp listeners (usually only a few)
+var _udp_reply_batches: std.ArrayListUnmanaged(*UdpReplyBatch) = .{};
+
+/// replies to the udp clients of a listener. \
+/// the replies produced in one loop iteration are sent with a single sendmmsg.
+const UdpReplyBatch = struct {
+    fdobj: *EvLoop.Fd, // udp listener
+    n: usize = 0, // number of pending replies
+    used: usize = 0, // used bytes of `buf`
+    addrs: [UDP_BATCH_MAX]cc.SockAddr = undefined,
+    iovs: [UDP_BATCH_MAX]cc.iovec_t = undefined,
+    buf: [BUFSZ]u8 = undefined,
 
-const TcpSender = struct {
-    list: Node, // queue head
-    pop_co: ?anyframe = null, // suspending on pop()
-    sending_time: u64 = 0, // start time (ms)
-    sending_fdobj: *EvLoop.Fd = undefined,
+    const BUFSZ = UDP_BATCH_MAX * c.DNS_EDNS_MINSIZE * 2;
 
-    const TaskNode = struct {
-        node: Node, // queue node
-        task: Task,
+    pub fn new(fdobj: *EvLoop.Fd) *UdpReplyBatch {
+        const self = g.allocator.create(UdpReplyBatch) catch unreachable;
+        self.* = .{ .fdobj = fdobj };
+        _udp_reply_batches.append(g.allocator, self) catch unreachable;
+        return self;
+    }
+
+    pub fn free(self: *UdpReplyBatch) void {
+        self.flush();
 
-        pub fn from_node(node: *Node) *TaskNode {
-            return @fieldParentPtr(TaskNode, "node", node);
+        for (_udp_reply_batches.items) |batch, i| {
+            if (batch == self) {
+                _ = _udp_reply_batches.swapRemove(i);
+                break;
+            }
         }
-    };
 
-    const Task = struct {
-        fdobj: *EvLoop.Fd, // raw_ptr (sync_ctx) | referenced (async_ctx)
-        data: union(enum) {
-            iovec: []cc.iovec_t, // raw_ptr (sync_ctx)
-            bytes: []const u8, // copied (async_ctx)
-        },
+        g.allocator.destroy(self);
+    }
 
-        pub fn in_sync_ctx(self: *const Task) bool {
-            return self.data == .iovec;
+    /// the batch of the udp listener
+    pub fn get(fdobj: *const EvLoop.Fd) *UdpReplyBatch {
+        for (_udp_reply_batches.items) |batch| {
+            if (batch.fdobj == fdobj)
+                return batch;
         }
+        unreachable;
+    }
+
+    /// copy the reply into the batch (flush first if there is no space)
+    pub fn push(self: *UdpReplyBatch, src_addr: *const cc.SockAddr, iovec: []cc.iovec_t) void {
+        const len = cc.iovec_len(iovec);
 
-        pub fn ref(self: *Task) void {
-            assert(self.in_sync_ctx());
-            _ = self.fdobj.ref();
-            const bytes = cc.iovec_dupe(self.data.iovec);
-            self.data = .{ .bytes = bytes };
+        // very large reply, send it directly
+        if (len > BUFSZ) {
+            const msghdr = cc.msghdr_t{
+                .msg_name = cc.remove_const(src_addr),
+                .msg_namelen = src_addr.len(),
+                .msg_iov = iovec.ptr,
+                .msg_iovlen = iovec.len,
+            };
+            _ = cc.sendmsg(self.fdobj.fd, &msghdr, 0);
+            return;
         }
 
-        pub fn unref(self: *const Task) void {
-            assert(!self.in_sync_ctx());
-            self.fdobj.unref();
-            g.allocator.free(self.data.bytes);
+        if (self.n >= UDP_BATCH_MAX or self.used + len > BUFSZ)
+            self.flush();
+
+        const data = self.buf[self.used .. self.used + len];
+        var offset: usize = 0;
+        for (iovec) |*iov| {
+            @memcpy(data[offset..].ptr, iov.iov_base, iov.iov_len);
+            offset += iov.iov_len;
         }
-    };
 
-    pub fn init(self: *TcpSender) void {
-        self.* = .{
-            .list = undefined,
+        self.addrs[self.n] = src_addr.*;
+        self.iovs[self.n] = .{
+            .iov_base = data.ptr,
+            .iov_len = data.len,
         };
-        self.list.init();
+        self.n += 1;
+        self.used += len;
+    }
+
+    /// send all pending replies (sendmmsg)
+    pub fn flush(self: *UdpReplyBatch) void {
+        if (self.n == 0) return;
 
-        co.start(sender, .{self});
+        defer {
+            self.n = 0;
+            self.used = 0;
+        }
+
+        stats.udp_send_batch.add(self.n);
+
+        var msgv: [UDP_BATCH_MAX]cc.mmsghdr_t = undefined;
+        for (msgv[0..self.n]) |*m, i| {
+            m.* = .{
+                .msg_hdr = .{
+                    .msg_name = &self.addrs[i],
+                    .msg_namelen = self.addrs[i].len(),
+                    .msg_iov = self.iovs[i..].ptr,
+                    .msg_iovlen = 1,
+                },
+            };
+        }
+
+        var msgs: []cc.mmsghdr_t = msgv[0..self.n];
+        while (msgs.len > 0) {
+            const sent = cc.sendmmsg(self.fdobj.fd, msgs, 0) orelse {
+                // skip the failed one (same as the sendmsg)
+                msgs = msgs[1..];
+                continue;
+            };
+            msgs = msgs[sent.len..];
+        }
     }
 
-    fn sender(self: *TcpSender) void {
-        defer co.terminate(@frame(), @frameSize(sender));
+    pub fn flush_all() void {
+        for (_udp_reply_batches.items) |batch|
+            batch.flush();
+    }
+};
 
-        while (true) {
-            var task: Task = undefined;
-            self.pop(&task);
-
-            const src = @src();
-            var logging = false;
-
-            if (task.in_sync_ctx()) {
-                const total = cc.iovec_len(task.data.iovec);
-
-                // try sending it directly (non-blocking)
-                const sent = cc.writev(task.fdobj.fd, task.data.iovec) orelse switch (cc.errno()) {
-                    c.EAGAIN => 0,
-                    else => {
-                        on_error(task.fdobj);
-                        continue;
-                    },
-                };
+// =========================================================================
+
+/// output queue of the tcp client (exists only when there is pending output)
+const TcpConn = struct {
+    node: Node = undefined, // _tcp_writing list
+    fdobj: *EvLoop.Fd, // referenced
+    out: std.ArrayListUnmanaged(u8) = .{}, // replies of this loop iteration (coalesced)
+    sending: std.ArrayListUnmanaged(u8) = .{}, // being sent by the writer (blocked)
+    sending_time: u64 = 0, // last progress of the writer (ms), 0 means no writer
+    queued: bool = false, // in the _tcp_pending list
+    reader_co: ?anyframe = null, // tcp_server waiting for the queue to drain
+
+    /// stop reading new queries if the pending output exceeds this
+    const PENDING_MAX = 64 * 1024;
+
+    /// give up the client if it doesn't read for this long
+    const WRITE_TIMEOUT = 5000; // ms
+
+    fn pending(self: *const TcpConn) usize {
+        return self.out.items.len + self.sending.items.len;
+    }
+
+    /// [sync && nosuspend] copy the reply to the queue of the client
+    pub fn push(fdobj: *EvLoop.Fd, iovec: []const cc.iovec_t) void {
+        const res = _tcp_conns.getOrPut(g.allocator, fdobj) catch unreachable;
+        if (!res.found_existing) {
+            const self = g.allocator.create(TcpConn) catch unreachable;
+            self.* = .{ .fdobj = fdobj.ref() };
+            res.value_ptr.* = self;
+        }
+        const self = res.value_ptr.*;
+
+        for (iovec) |*iov|
+            self.out.appendSlice(g.allocator, iov.iov_base[0..iov.iov_len]) catch unreachable;
+
+        // the writer will send it
+        if (self.sending_time > 0 or self.queued)
+            return;
+
+        self.queued = true;
+        _tcp_pending.append(g.allocator, self) catch unreachable;
+    }
+
+    /// [check_timeout] send the queued replies of this loop iteration
+    pub fn flush_all() void {
+        // the list may grow during the iteration
+        var i: usize = 0;
+        while (i < _tcp_pending.items.len) : (i += 1) {
+            const self = _tcp_pending.items[i];
+            self.queued = false;
+            self.flush();
+        }
+        _tcp_pending.clearRetainingCapacity();
+    }
 
-                // in the vast majority of cases it can be sent all at once
-                if (sent == total) continue;
+    fn flush(self: *TcpConn) void {
+        // in the vast majority of cases it can be sent all at once
+        const sent = cc.send(self.fdobj.fd, self.out.items, 0) orelse switch (cc.errno()) {
+            c.EAGAIN => 0,
+            else => {
+                on_error(self.fdobj);
+                return self.free();
+            },
+        };
+
+        if (sent == self.out.items.len)
+            return self.free();
 
-                // very unfortunately
-                assert(sent < total);
-                cc.iovec_skip(&task.data.iovec, sent);
+        // the client is slow, only this connection is blocked
+        self.out.replaceRange(g.allocator, 0, sent, &.{}) catch unreachable;
+        co.start(writer, .{self});
+    }
 
-                task.ref();
+    /// [suspending] like `evloop.write`, the timeout is restarted on each partial write
+    fn write(self: *TcpConn, data: []const u8) ?void {
+        var nsend: usize = 0;
 
-                log.warn(
-                    src,
-                    "send(fd:%d, total:%zu, sent:%zu) blocking ...",
-                    .{ task.fdobj.fd, total, sent },
-                );
-                logging = true;
+        while (true) {
+            if (self.fdobj.is_canceled())
+                return null;
+
+            if (cc.send(self.fdobj.fd, data[nsend..], 0)) |n| {
+                nsend += n;
+                if (nsend == data.len)
+                    return;
+
+                // progress, _tcp_writing is still ordered by sending_time
+                self.sending_time = g.evloop.time;
+                self.node.unlink();
+                _tcp_writing.link_to_tail(&self.node);
+            } else {
+                if (cc.errno() != c.EAGAIN)
+                    return null;
             }
 
-            self.sending_time = g.evloop.time;
-            self.sending_fdobj = task.fdobj;
+            g.evloop.wait_writable(self.fdobj) orelse return null;
+        }
+    }
+
+    fn writer(self: *TcpConn) void {
+        defer co.terminate(@frame(), @frameSize(writer));
 
-            g.evloop.write(task.fdobj, task.data.bytes) orelse on_error(task.fdobj);
+        while (self.out.items.len > 0) {
+            std.mem.swap(std.ArrayListUnmanaged(u8), &self.out, &self.sending);
+
+            self.sending_time = g.evloop.time;
+            _tcp_writing.link_to_tail(&self.node);
 
-            if (logging)
-                log.warn(
-                    src,
-                    "send(fd:%d, bytes:%zu, time:%llu) blocking end",
-                    .{ task.fdobj.fd, task.data.bytes.len, cc.to_ulonglong(g.evloop.time - self.sending_time) },
-                );
+            const ok = self.write(self.sending.items) != null;
 
+            self.node.unlink();
             self.sending_time = 0;
-            self.sending_fdobj = undefined;
+            self.sending.clearRetainingCapacity();
 
-            task.unref();
+            if (!ok) {
+                on_error(self.fdobj);
+                self.out.clearRetainingCapacity();
+                self.fdobj.cancel(); // stop reading
+            }
+
+            if (self.pending() <= PENDING_MAX)
+                self.wake_reader(); // may push new replies
         }
+
+        self.free();
     }
 
     fn on_error(fdobj: *const EvLoop.Fd) void {
         log.warn(@src(), "send(fd:%d) failed: (%d) %m", .{ fdobj.fd, cc.errno() });
     }
 
-    pub fn get_deadline(self: *const TcpSender) ?u64 {
-        if (self.sending_time > 0)
-            return self.sending_time + 100; // 100ms
-        return null;
+    fn wake_reader(self: *TcpConn) void {
+        if (self.reader_co) |frame| {
+            self.reader_co = null;
+            co.do_resume(frame);
+        }
     }
 
-    pub fn on_timeout(self: *TcpSender) void {
-        assert(self.sending_time > 0);
-        self.sending_fdobj.cancel();
-    }
+    fn free(self: *TcpConn) void {
+        assert(_tcp_conns.remove(self.fdobj));
 
-    fn co_data() *Task {
-        return co.data(Task);
-    }
+        const reader_co = self.reader_co;
 
-    fn pop(self: *TcpSender, task: *Task) void {
-        if (self.list.is_empty()) {
-            self.pop_co = @frame();
-            suspend {}
-            self.pop_co = null;
+        self.fdobj.unref();
+        self.out.deinit(g.allocator);
+        self.sending.deinit(g.allocator);
+        g.allocator.destroy(self);
 
-            task.* = co_data().*;
-        } else {
-            const task_node = TaskNode.from_node(self.list.head());
-            task_node.node.unlink();
+        if (reader_co) |frame|
+            co.do_resume(frame);
+    }
 
-            task.* = task_node.task;
+    /// [tcp_server] backpressure: wait for the output queue to drain
+    pub fn wait_drained(fdobj: *EvLoop.Fd) void {
+        const self = _tcp_conns.get(fdobj) orelse return;
+        if (self.pending() <= PENDING_MAX) return;
 
-            g.allocator.destroy(task_node);
-        }
+        // resumed by the writer (reader_co is reset by the waker)
+        self.reader_co = @frame();
+        suspend {}
     }
 
-    pub fn send(self: *TcpSender, fdobj: *EvLoop.Fd, iovec: []cc.iovec_t) void {
-        if (self.pop_co) |pop_co| {
-            assert(self.list.is_empty());
-            co_data().* = .{
-                .fdobj = fdobj,
-                .data = .{ .iovec = iovec },
-            };
-            co.do_resume(pop_co);
-        } else {
-            const task_node = g.allocator.create(TaskNode) catch unreachable;
-            task_node.* = .{
-                .task = .{
-                    .fdobj = fdobj,
-                    .data = .{ .iovec = iovec },
-                },
-                .node = undefined,
-            };
-            task_node.task.ref();
-            self.list.link_to_tail(&task_node.node);
+    /// [check_timeout] cancel the blocked client
+    pub fn check_timeout(timer: *EvLoop.Timer) void {
+        while (!_tcp_writing.is_empty()) {
+            const self = from_node(_tcp_writing.head());
+            if (!timer.check_deadline(self.sending_time + WRITE_TIMEOUT))
+                break;
+            log.warn(@src(), "send(fd:%d, pending:%zu) timeout", .{ self.fdobj.fd, self.pending() });
+            nosuspend self.fdobj.cancel(); // the writer will be resumed and unlinked
         }
     }
+
+    fn from_node(node: *Node) *TcpConn {
+        return @fieldParentPtr(TcpConn, "node", node);
+    }
 };
 
+/// fdobj => tcp client with pending output
+var _tcp_conns: std.AutoHashMapUnmanaged(*EvLoop.Fd, *TcpConn) = .{};
+
+/// have new replies in this loop iteration
+var _tcp_pending: std.ArrayListUnmanaged(*TcpConn) = .{};
+
+/// blocked on sending, ordered by sending_time
+var _tcp_writing: Node = undefined;
+
 // =========================================================================
 
 pub fn check_timeout(timer: *EvLoop.Timer) void {
-    // check tcp_sender
-    while (_tcp_sender.get_deadline()) |deadline| {
-        if (timer.check_deadline(deadline))
-            nosuspend _tcp_sender.on_timeout()
-        else
+    // overload state of the admission control
+    const oldest_age = if (_query_list.list.is_empty())
+        0
+    else
+        g.evloop.time - Query.from_node(_query_list.list.head()).req_time;
+    admission.update(_query_list.count(), oldest_age);
+
+    // refresh the popular cache before it expires
+    while (cache.next_prefetch(timer)) |cache_msg|
+        nosuspend prefetch(cache_msg);
+
+    // fall back if the group doesn't reply in time
+    while (!_fallback_list.is_empty()) {
+        const fallback = Fallback.from_node(_fallback_list.head());
+        if (!timer.check_deadline(fallback.deadline))
             break;
+        nosuspend fallback.fire();
     }
 
     // check query_list
@@ -1037,6 +1731,17 @@ pub fn check_timeout(timer: *EvLoop.Timer) void {
         else
             break;
     }
+
+    // must be at the end: the timers above may reply (stale fallback, timeout)
+
+    // send the udp replies of this loop iteration
+    UdpReplyBatch.flush_all();
+
+    // send the tcp replies of this loop iteration
+    TcpConn.flush_all();
+
+    // check the blocked tcp clients
+    TcpConn.check_timeout(timer);
 }
 
 // =========================================================================
@@ -1048,10 +1753,14 @@ noinline fn do_start(ip: cc.ConstStr, port: u16, socktype: net.SockType) void {
         cc.bind(fd, &addr) orelse break :e "bind";
         switch (socktype) {
             .tcp => {
+                if (g.flags.tcp_fastopen)
+                    net.setup_tcp_fastopen(fd);
                 cc.listen(fd, 1024) orelse break :e "listen";
                 co.start(tcp_listener, .{ fd, ip, port });
             },
             .udp => {
+                if (g.flags.worker_qname_hash and g.worker_n > 1)
+                    net.setup_qname_steering(fd, g.worker_n);
                 co.start(udp_server, .{ fd, ip, port });
             },
         }
@@ -1069,7 +1778,8 @@ noinline fn do_start(ip: cc.ConstStr, port: u16, socktype: net.SockType) void {
 
 pub fn start() void {
     _query_list.init();
-    _tcp_sender.init();
+    _fallback_list.init();
+    _tcp_writing.init();
 
     for (g.bind_ips.items()) |ip| {
         for (g.bind_ports) |p| {
@@ -0,0 +1,268 @@
+//! runtime counters, printed to the log on SIGUSR1
+
+const std = @import("std");
+const cc = @import("cc.zig");
+const log = @import("log.zig");
+const worker = @import("worker.zig");
+const groups = @import("groups.zig");
+const testing = std.testing;
+const assert = std.debug.assert;
+
+// ======================================================
+
+/// log2 distribution of positive integers (e.g. batch size)
+pub const Histogram = struct {
+    /// [i]: number of values in the range [2^i, 2^(i+1)), the last one is unbounded
+    buckets: [N]u64 = [_]u64{0} ** N,
+    sum: u64 = 0, // sum of all values
+
+    const N = 8;
+
+    pub fn add(self: *Histogram, value: usize) void {
+        assert(value > 0);
+        const i = std.math.min(std.math.log2_int(usize, value), N - 1);
+        self.buckets[i] += 1;
+        self.sum += value;
+    }
+
+    /// number of values
+    pub fn count(self: *const Histogram) u64 {
+        var n: u64 = 0;
+        for (self.buckets) |v|
+            n += v;
+        return n;
+    }
+
+    pub fn avg(self: *const Histogram) f64 {
+        const n = self.count();
+        if (n == 0) return 0;
+        return @intToFloat(f64, self.sum) / @intToFloat(f64, n);
+    }
+
+    /// "1:N 2-3:N 4-7:N ..." (empty buckets are omitted)
+    pub fn to_text(self: *const Histogram, buf: []u8) [:0]const u8 {
+        var len: usize = 0;
+        buf[0] = 0;
+        for (self.buckets) |v, i| {
+            if (v == 0 or len + 2 >= buf.len) continue;
+            const lo = @as(usize, 1) << @intCast(u6, i);
+            const s = if (lo == 1)
+                cc.snprintf(buf[len..], " 1:%llu", .{cc.to_ulonglong(v)})
+            else if (i == N - 1)
+                cc.snprintf(buf[len..], " %zu+:%llu", .{ lo, cc.to_ulonglong(v) })
+            else
+                cc.snprintf(buf[len..], " %zu-%zu:%llu", .{ lo, lo * 2 - 1, cc.to_ulonglong(v) });
+            len += s.len;
+        }
+        return buf[0..len :0];
+    }
+
+    pub fn dump(self: *const Histogram, comptime name: [:0]const u8) void {
+        var buf: [256]u8 = undefined;
+        log.info(@src(), "%s: n:%llu avg:%.2f |%s", .{
+            name.ptr,
+            cc.to_ulonglong(self.count()),
+            self.avg(),
+            self.to_text(&buf).ptr,
+        });
+    }
+};
+
+// ======================================================
+
+/// queries from udp/tcp clients
+pub var queries: u64 = 0;
+
+/// queries answered from the dns cache
+pub var cache_hits: u64 = 0;
+
+/// cache hits answered before the ascii decoding and dnl lookup (fast lane)
+pub var cache_fast_hits: u64 = 0;
+
+/// queries forwarded to upstream
+pub var forwarded: u64 = 0;
+
+/// queries attached to an in-flight query of the same question (not forwarded)
+pub var coalesced: u64 = 0;
+
+/// prefetch queries sent for popular cache (`--cache-prefetch`)
+pub var prefetches: u64 = 0;
+
+/// first hits of the prefetched cache (would have been a miss or refresh)
+pub var prefetch_hits: u64 = 0;
+
+/// queries refused by the client token bucket (`--client-qps`)
+pub var shed_rate_limit: u64 = 0;
+
+/// queries refused because too many requesters wait for the same in-flight query
+pub var shed_waiters: u64 = 0;
+
+/// queries answered with SERVFAIL under overload (`--max-pending`)
+pub var shed_overload: u64 = 0;
+
+/// queries answered from the expired cache under overload
+pub var shed_stale: u64 = 0;
+
+/// queries sent to the backup upstream (`--upstream-hedge`)
+pub var hedges: u64 = 0;
+
+/// hedged queries answered by the backup upstream
+pub var hedge_wins: u64 = 0;
+
+/// udp queries sent again after the rto of the upstream
+pub var retransmits: u64 = 0;
+
+/// circuit breaker: upstreams taken out of rotation, and the health probes sent to them
+pub var circuit_opens: u64 = 0;
+pub var probes: u64 = 0;
+
+/// queries answered from the expired cache while the upstreams are down
+pub var circuit_stale: u64 = 0;
+
+/// `--fallback`: queries re-dispatched to the fallback group, and answered from the expired cache
+pub var fallbacks: u64 = 0;
+pub var fallback_stale: u64 = 0;
+
+/// tls handshakes with the upstream (DoT)
+pub var tls_full: u64 = 0;
+pub var tls_full_ms: u64 = 0; // total handshake time
+pub var tls_resumed: u64 = 0;
+pub var tls_resumed_ms: u64 = 0; // total handshake time
+
+/// queries sent as tls13 0-RTT data, and those accepted by the upstream
+pub var tls_early_data: u64 = 0;
+pub var tls_early_data_accepted: u64 = 0;
+
+/// tls connections whose tx is encrypted by the kernel (`--ktls`), and the failures
+pub var ktls: u64 = 0;
+pub var ktls_failed: u64 = 0;
+
+/// tcp/tls upstream connections, and those with the idle timeout advertised by the upstream (`--edns-keepalive`)
+pub var tcp_connects: u64 = 0;
+pub var keepalive: u64 = 0;
+
+/// tcp/tls upstream connections with `--tcp-fastopen`:
+/// - ok: the first write was carried by the SYN and acked
+/// - rejected: the data in the SYN was not accepted (sent after the handshake)
+/// - fallback: no cookie for the upstream (or not supported), normal connect
+pub var tfo_ok: u64 = 0;
+pub var tfo_rejected: u64 = 0;
+pub var tfo_fallback: u64 = 0;
+
+/// datagrams per recvmmsg() on the udp listener
+pub var udp_recv_batch: Histogram = .{};
+
+/// replies per sendmmsg() on the udp listener
+pub var udp_send_batch: Histogram = .{};
+
+/// datagrams per recvmmsg() on the udp upstream socket
+pub var upstream_recv_batch: Histogram = .{};
+
+/// queries per read() on the tcp client connection (pipelining)
+pub var tcp_read_msgs: Histogram = .{};
+
+/// replies per read() on the tcp/tls upstream connection
+pub var upstream_tcp_read_msgs: Histogram = .{};
+
+/// queries per write on the tcp/tls upstream connection (writev, tls record, or http2 flush)
+pub var upstream_tcp_send_msgs: Histogram = .{};
+
+// ======================================================
+
+fn percent(part: u64, total: u64) f64 {
+    if (total == 0) return 0;
+    return @intToFloat(f64, part) * 100 / @intToFloat(f64, total);
+}
+
+fn average(sum: u64, n: u64) f64 {
+    if (n == 0) return 0;
+    return @intToFloat(f64, sum) / @intToFloat(f64, n);
+}
+
+/// print all counters (SIGUSR1)
+pub fn dump() void {
+    log.info(@src(), "worker:%u queries:%llu cache_hits:%llu (%.2f%%) cache_fast_hits:%llu forwarded:%llu coalesced:%llu", .{
+        cc.to_uint(worker.id),
+        cc.to_ulonglong(queries),
+        cc.to_ulonglong(cache_hits),
+        percent(cache_hits, queries),
+        cc.to_ulonglong(cache_fast_hits),
+        cc.to_ulonglong(forwarded),
+        cc.to_ulonglong(coalesced),
+    });
+    log.info(@src(), "prefetches:%llu prefetch_hits:%llu", .{
+        cc.to_ulonglong(prefetches),
+        cc.to_ulonglong(prefetch_hits),
+    });
+    log.info(@src(), "hedges:%llu (%.2f%%) hedge_wins:%llu", .{
+        cc.to_ulonglong(hedges),
+        percent(hedges, forwarded),
+        cc.to_ulonglong(hedge_wins),
+    });
+    log.info(@src(), "retransmits:%llu (%.2f%%)", .{
+        cc.to_ulonglong(retransmits),
+        percent(retransmits, forwarded),
+    });
+    log.info(@src(), "circuit_opens:%llu probes:%llu circuit_stale:%llu", .{
+        cc.to_ulonglong(circuit_opens),
+        cc.to_ulonglong(probes),
+        cc.to_ulonglong(circuit_stale),
+    });
+    log.info(@src(), "fallbacks:%llu fallback_stale:%llu", .{
+        cc.to_ulonglong(fallbacks),
+        cc.to_ulonglong(fallback_stale),
+    });
+    log.info(@src(), "shed_rate_limit:%llu shed_waiters:%llu shed_overload:%llu shed_stale:%llu", .{
+        cc.to_ulonglong(shed_rate_limit),
+        cc.to_ulonglong(shed_waiters),
+        cc.to_ulonglong(shed_overload),
+        cc.to_ulonglong(shed_stale),
+    });
+    log.info(@src(), "tls_full:%llu (avg %.2fms) tls_resumed:%llu (avg %.2fms) tls_early_data:%llu accepted:%llu", .{
+        cc.to_ulonglong(tls_full),
+        average(tls_full_ms, tls_full),
+        cc.to_ulonglong(tls_resumed),
+        average(tls_resumed_ms, tls_resumed),
+        cc.to_ulonglong(tls_early_data),
+        cc.to_ulonglong(tls_early_data_accepted),
+    });
+    log.info(@src(), "ktls:%llu ktls_failed:%llu", .{
+        cc.to_ulonglong(ktls),
+        cc.to_ulonglong(ktls_failed),
+    });
+    log.info(@src(), "tcp_connects:%llu keepalive:%llu", .{
+        cc.to_ulonglong(tcp_connects),
+        cc.to_ulonglong(keepalive),
+    });
+    log.info(@src(), "tfo_ok:%llu tfo_rejected:%llu tfo_fallback:%llu", .{
+        cc.to_ulonglong(tfo_ok),
+        cc.to_ulonglong(tfo_rejected),
+        cc.to_ulonglong(tfo_fallback),
+    });
+    udp_recv_batch.dump("udp_recv_batch");
+    udp_send_batch.dump("udp_send_batch");
+    upstream_recv_batch.dump("upstream_recv_batch");
+    tcp_read_msgs.dump("tcp_read_msgs");
+    upstream_tcp_read_msgs.dump("upstream_tcp_read_msgs");
+    upstream_tcp_send_msgs.dump("upstream_tcp_send_msgs");
+    groups.dump_upstream_stats();
+}
+
+// ======================================================
+
+pub fn @"test: histogram"() !void {
+    var h: Histogram = .{};
+    h.add(1);
+    h.add(3);
+    h.add(16);
+    h.add(1000);
+
+    try testing.expectEqual(@as(u64, 4), h.count());
+    try testing.expectEqual(@as(u64, 1), h.buckets[0]);
+    try testing.expectEqual(@as(u64, 1), h.buckets[1]);
+    try testing.expectEqual(@as(u64, 1), h.buckets[4]);
+    try testing.expectEqual(@as(u64, 1), h.buckets[Histogram.N - 1]);
+
+    var buf: [128]u8 = undefined;
+    try testing.expectEqualStrings(" 1:1 2-3:1 16-31:1 128+:1", h.to_text(&buf));
+}
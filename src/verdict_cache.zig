@@ -4,6 +4,7 @@ const c = @import("c.zig");
 const cc = @import("cc.zig");
 const dns = @import("dns.zig");
 const log = @import("log.zig");
+const worker = @import("worker.zig");
 const str2int = @import("str2int.zig");
 const assert = std.debug.assert;
 
@@ -73,7 +74,9 @@ pub fn load() void {
     assert(g.verdict_cache_size > 0);
 
     const src = @src();
-    const path = g.verdict_cache_db orelse return;
+
+    var pathbuf: [c.PATH_MAX]u8 = undefined;
+    const path = worker.db_path(g.verdict_cache_db orelse return, &pathbuf);
 
     const mem = cc.mmap_file(path) orelse {
         if (cc.errno() != c.ENOENT)
@@ -131,10 +134,11 @@ pub fn dump(event: enum { on_exit, on_manual }) void {
 
     const src = @src();
 
-    const path = g.verdict_cache_db orelse switch (event) {
+    var pathbuf: [c.PATH_MAX]u8 = undefined;
+    const path = worker.db_path(g.verdict_cache_db orelse switch (event) {
         .on_exit => return,
         .on_manual => "/tmp/chinadns@verdict-cache.db",
-    };
+    }, &pathbuf);
 
     var count: usize = 0;
 
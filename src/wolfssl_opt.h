@@ -1,7 +1,8 @@
 #pragma once
 
 #define NO_WOLFSSL_SERVER
-#define NO_SESSION_CACHE
+#define NO_CLIENT_CACHE
+#define SMALL_SESSION_CACHE
 #define WOLFSSL_NO_ATOMICS
 #define WOLFSSL_AEAD_ONLY
 #define LARGE_STATIC_BUFFERS
@@ -0,0 +1,169 @@
+//! worker mode (`--workers N`): N shared-nothing worker processes. \
+//! each worker has its own evloop, listening sockets (SO_REUSEPORT),
+//! query list, caches and upstream sessions. \
+//! read-only data (domain name list, local records, ...) is shared by copy-on-write. \
+//! the main process only supervises the workers (forward signals, respawn).
+
+const g = @import("g.zig");
+const c = @import("c.zig");
+const cc = @import("cc.zig");
+const log = @import("log.zig");
+const ipset = @import("ipset.zig");
+const EvLoop = @import("EvLoop.zig");
+
+/// max number of workers
+pub const MAX: u8 = 64;
+
+/// `0`: not a worker process, `1..N`: worker id
+pub var id: u8 = 0;
+
+const Worker = struct {
+    pid: c.pid_t = 0, // 0 means exited
+    start_time: u64 = 0, // monotonic time (ms)
+};
+
+var _workers: [MAX]Worker = [_]Worker{.{}} ** MAX;
+
+/// SIGINT/SIGTERM received (or a worker failed to start)
+var _stopping: bool = false;
+var _exit_status: c_int = 0;
+
+pub inline fn enabled() bool {
+    return g.worker_n > 1;
+}
+
+/// "path.<id>" for worker process, else "path" (db file)
+pub fn db_path(path: cc.ConstStr, buf: []u8) cc.ConstStr {
+    if (id == 0) return path;
+    return cc.snprintf(buf, "%s.%u", .{ path, cc.to_uint(id) }).ptr;
+}
+
+/// fork the workers, return only in the worker process
+pub fn start() void {
+    if (!enabled()) return;
+
+    // each worker binds its own listening sockets
+    g.flags.reuse_port = true;
+
+    // handled synchronously by the supervisor (sigwaitinfo)
+    c.sig_mask_supervisor(true);
+
+    var i: u8 = 1;
+    while (i <= g.worker_n) : (i += 1) {
+        if (spawn(i)) return; // worker
+    }
+
+    supervise(); // return only in the respawned worker
+}
+
+/// return true if in the worker process
+fn spawn(worker_id: u8) bool {
+    const pid = cc.fork() orelse {
+        log.err(@src(), "fork() failed: (%d) %m", .{cc.errno()});
+        cc.exit(1);
+    };
+
+    if (pid == 0) {
+        on_start(worker_id);
+        return true;
+    }
+
+    _workers[worker_id - 1] = .{
+        .pid = pid,
+        .start_time = cc.monotime(),
+    };
+
+    log.info(@src(), "worker:%u started, pid:%d", .{ cc.to_uint(worker_id), pid });
+
+    return false;
+}
+
+/// setup the process-private state
+fn on_start(worker_id: u8) void {
+    id = worker_id;
+
+    c.sig_mask_supervisor(false);
+
+    // exit together with the supervisor
+    c.set_pdeathsig(c.SIGTERM);
+
+    // the epoll instance is shared with the parent process after fork()
+    _ = cc.close(g.evloop.epfd);
+    g.evloop = EvLoop.init();
+
+    // the netlink socket is shared with the parent process after fork()
+    ipset.on_fork();
+
+    if (g.flags.worker_cpu_pin and !c.set_cpu_affinity(worker_id - 1))
+        log.warn(@src(), "worker:%u sched_setaffinity() failed: (%d) %m", .{ cc.to_uint(worker_id), cc.errno() });
+}
+
+/// return only in the respawned worker
+fn supervise() void {
+    while (true) {
+        const sig = c.sig_wait_supervisor();
+        switch (sig) {
+            c.SIGCHLD => if (reap()) return,
+            c.SIGINT, c.SIGTERM => {
+                _stopping = true;
+                broadcast(sig);
+            },
+            c.SIGUSR1, c.SIGUSR2 => broadcast(sig),
+            else => log.warn(@src(), "sigwaitinfo() failed: (%d) %m", .{cc.errno()}),
+        }
+    }
+}
+
+fn broadcast(sig: c_int) void {
+    for (_workers[0..g.worker_n]) |*w| {
+        if (w.pid > 0)
+            _ = cc.kill(w.pid, sig);
+    }
+}
+
+/// return true if in the respawned worker
+fn reap() bool {
+    const src = @src();
+
+    while (true) {
+        var status: c_int = undefined;
+        const pid = cc.waitpid(-1, &status, c.WNOHANG) orelse 0;
+        if (pid <= 0) break;
+
+        const i = for (_workers[0..g.worker_n]) |*w, idx| {
+            if (w.pid == pid) break idx;
+        } else continue;
+
+        const w = &_workers[i];
+        const worker_id = cc.to_u8(i + 1);
+        w.pid = 0;
+
+        if (_stopping) {
+            if (all_exited()) cc.exit(_exit_status);
+            continue;
+        }
+
+        log.warn(src, "worker:%u exited unexpectedly, pid:%d status:%d", .{ cc.to_uint(worker_id), pid, status });
+
+        // failed at startup (e.g. bind failed), there is no point in retrying
+        if (cc.monotime() < w.start_time + 1000) {
+            log.err(src, "worker:%u failed to start, stop all workers", .{cc.to_uint(worker_id)});
+            _stopping = true;
+            _exit_status = 1;
+            broadcast(c.SIGTERM);
+            if (all_exited()) cc.exit(_exit_status);
+            continue;
+        }
+
+        if (spawn(worker_id)) return true;
+    }
+
+    return false;
+}
+
+fn all_exited() bool {
+    for (_workers[0..g.worker_n]) |*w| {
+        if (w.pid > 0) return false;
+    }
+    return true;
+}